@@ -0,0 +1,752 @@
+/** @file bench.cc
+ * @brief Benchmarks of the GSEA phases on synthetic data
+ *
+ * Usage:
+ *
+ *     gsea-bench [sizes] [max threads]
+ *     gsea-bench --check [sizes] [threads]
+ *     gsea-bench --generate folder genes samples cells gene-sets [seed]
+ *
+ * sizes is a comma separated list of the size presets small, medium and large, or all for every preset, small by
+ * default. The first form times every phase for every size preset with 1, 2, 4, ... up to max threads (all the
+ * hardware threads by default) and prints a line per size, phase and thread count with the best time of 3
+ * repetitions, so one run sweeps the sizes and the thread counts:
+ *
+ *     benchmark size threads seconds throughput unit
+ *
+ * The second form scores the first samples of every size preset with reference paths, a comparator sort and a
+ * scalar running sum over every ranked position, and compares them with the radix and counting sorts, the vector
+ * running sum kernels and the scores of bulk, runChunked and the csv pipelines. It prints a line per check with
+ * the largest difference found and exits with a failure status if any check fails:
+ *
+ *     check size samples max-difference status
+ *
+ * The third form writes the synthetic data used by the benchmarks into folder: expression-matrix.csv (bulk),
+ * scrna-matrix.csv and gene-sets.csv. */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include "eskernel.hh"
+#include "gsea.hh"
+#include "resultwriter.hh"
+#include "synthetic.hh"
+
+using namespace std;
+
+/** @struct BenchSize
+ * @brief Sizes of the synthetic data of a benchmark preset */
+struct BenchSize
+{
+    const char *name;
+    uint nGenes;
+    /// Bulk samples
+    uint nSamples;
+    /// scRNA cells
+    uint nCells;
+    uint nGeneSets;
+};
+
+static const BenchSize benchSizes[] = {
+    {"small", 5000, 100, 1000, 300},
+    {"medium", 20000, 400, 5000, 2000},
+    {"large", 20000, 2000, 20000, 8000},
+};
+
+/// Repetitions of every benchmark, the best time is reported
+static const uint repetitions = 3;
+
+/// Cells of every runChunked chunk
+static const uint chunkCells = 1000;
+
+/// Fraction of non null scRNA counts
+static const double scRnaDensity = 0.1;
+
+/// Samples scored by the reference paths of --check, the reference ES walks every ranked position
+static const uint checkSamples = 32;
+
+/// Largest difference accepted between an ES and its reference, relative to the ES or to the terms of the running
+/// sum when they are larger, the kernels round the terms differently. The csv outputs have 6 digits.
+static const double checkTolerance = 1e-6;
+static const double csvTolerance = 1e-5;
+
+/** @struct QuietCout
+ * @brief Discards the standard output of the benchmarked code while it exists */
+struct QuietCout
+{
+    streambuf *saved;
+
+    QuietCout() : saved(cout.rdbuf(nullptr)) {}
+
+    ~QuietCout()
+    {
+        cout.rdbuf(saved);
+        cout.clear();
+    }
+};
+
+/**
+ * @brief Seconds since a time point
+ * @param start time point
+ * @return Elapsed seconds
+ */
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Prints a benchmark result line
+ * @param benchmark benchmark name
+ * @param size size preset
+ * @param nThreads number of threads
+ * @param seconds best time
+ * @param items items processed in seconds
+ * @param unit unit of the items
+ */
+static void report(const char *benchmark, const BenchSize &size, uint nThreads, double seconds, double items,
+                   const char *unit)
+{
+    printf("%-16s %-8s %7u %12.6f %14.1f %s/s\n", benchmark, size.name, nThreads, seconds, items / seconds, unit);
+    fflush(stdout);
+}
+
+/**
+ * @brief Deep copy of a matrix, copies of ExprMatrix share their buffer
+ * @param matrix matrix
+ * @return Matrix with its own buffer and the same counts
+ */
+static ExprMatrix copyMatrix(const ExprMatrix &matrix)
+{
+    ExprMatrix copy(matrix.nSamples, matrix.nGenes);
+    memcpy(copy.data, matrix.data, matrix.stride * matrix.nSamples * sizeof(float));
+    return copy;
+}
+
+/**
+ * @brief Writes the gsea.config read by the Gsea() benchmarks
+ * @param nThreads number of threads
+ * @param scRna true to read scrna-matrix.csv with the scRNA pipeline, false to read expression-matrix.csv
+ */
+static void writeConfig(uint nThreads, bool scRna = false)
+{
+    ofstream config("gsea.config");
+    config << "expression-matrix-file:     " << (scRna ? "scrna-matrix.csv" : "expression-matrix.csv") << "\n";
+    config << "sep:                        ,\n";
+    config << "gene-sets-file:             gene-sets.csv\n";
+    config << "sep:                        ,\n";
+    config << "output-file:                results.csv\n";
+    config << "sep:                        ,\n";
+    config << "threads-used:               " << nThreads << "\n";
+    config << "normalized-data:            1\n";
+    config << "ioutput:                    0\n";
+    config << "scrna:                      " << scRna << "\n";
+    config << "batch-size:                 50\n";
+}
+
+/**
+ * @brief Runs every benchmark of a size preset
+ * @param size size preset
+ * @param threadCounts thread counts of the sweep
+ */
+static void runBenchmarks(const BenchSize &size, const vector<uint> &threadCounts)
+{
+    vector<string> geneIds = syntheticIds("G", size.nGenes);
+    vector<string> sampleIds = syntheticIds("S", size.nSamples);
+    vector<string> cellIds = syntheticIds("C", size.nCells);
+    ExprMatrix bulkMatrix = syntheticBulkMatrix(size.nSamples, size.nGenes, 1);
+    ExprMatrix scRnaMatrix = syntheticScRnaMatrix(size.nCells, size.nGenes, scRnaDensity, 2);
+    GeneSets geneSets = syntheticGeneSets(size.nGeneSets, geneIds, 3);
+    writeBulkCsv("expression-matrix.csv", bulkMatrix, geneIds, sampleIds);
+    writeGeneSetsCsv("gene-sets.csv", geneSets);
+
+    // Non integer counts, so the floats are ranked with the radix sort instead of the counting sort
+    ExprMatrix floatMatrix = copyMatrix(bulkMatrix);
+    for (uint j = 0; j < floatMatrix.nSamples; ++j)
+    {
+        for (uint i = 0; i < floatMatrix.nGenes; ++i)
+            floatMatrix.sample(j)[i] = log1p(floatMatrix.sample(j)[i]) - 2.5f;
+    }
+
+    printf("# size %s: genes=%u samples=%u cells=%u gene-sets=%u\n", size.name, size.nGenes, size.nSamples,
+           size.nCells, size.nGeneSets);
+
+    double csvBytes = filesystem::file_size("expression-matrix.csv");
+    double bulkBytes = double(size.nSamples) * size.nGenes * sizeof(float);
+    double bulkScores = double(size.nSamples) * size.nGeneSets;
+    double scRnaScores = double(size.nCells) * size.nGeneSets;
+    for (uint nThreads : threadCounts)
+    {
+        double best[8];
+        fill(best, best + 8, 1e300);
+        for (uint r = 0; r < repetitions; ++r)
+        {
+            QuietCout quiet;
+            chrono::steady_clock::time_point start;
+
+            // Csv parsing, Gsea() also reads and reconciles the gene sets
+            writeConfig(nThreads);
+            start = chrono::steady_clock::now();
+            {
+                Gsea gsea;
+                best[0] = min(best[0], secondsSince(start));
+            }
+
+            {
+                Gsea gsea(geneSets, copyMatrix(bulkMatrix), geneIds, sampleIds, nThreads, false);
+                start = chrono::steady_clock::now();
+                gsea.normalizeExprMatrix();
+                best[1] = min(best[1], secondsSince(start));
+            }
+
+            {
+                ThreadPool pool(nThreads);
+                vector<RankScratch> scratches = vector<RankScratch>(nThreads);
+                vector<vector<uint32_t>> orders = vector<vector<uint32_t>>(nThreads, vector<uint32_t>(size.nGenes));
+                start = chrono::steady_clock::now();
+                pool.parallelFor(size.nCells, [&](uint j, uint worker)
+                {
+                    rankGenes(scRnaMatrix.sample(j), size.nGenes, scratches[worker], orders[worker].data());
+                });
+                best[2] = min(best[2], secondsSince(start));
+                start = chrono::steady_clock::now();
+                pool.parallelFor(size.nSamples, [&](uint j, uint worker)
+                {
+                    rankGenes(floatMatrix.sample(j), size.nGenes, scratches[worker], orders[worker].data());
+                });
+                best[3] = min(best[3], secondsSince(start));
+            }
+
+            {
+                Gsea gsea(geneSets, bulkMatrix, geneIds, sampleIds, nThreads, false);
+                start = chrono::steady_clock::now();
+                gsea.run("", 0);
+                best[4] = min(best[4], secondsSince(start));
+            }
+
+            {
+                Gsea gsea(cellIds, geneIds, geneSets, nThreads);
+                gsea.setWriteScores(false);
+                start = chrono::steady_clock::now();
+                gsea.runChunked(scRnaMatrix);
+                best[5] = min(best[5], secondsSince(start));
+            }
+
+            {
+                Gsea gsea(cellIds, geneIds, geneSets, nThreads);
+                start = chrono::steady_clock::now();
+                for (uint c = 0; c < size.nCells; c += chunkCells)
+                {
+                    ExprMatrix chunk = scRnaMatrix.slice(c, min(chunkCells, size.nCells - c));
+                    gsea.runChunked(chunk);
+                }
+                best[6] = min(best[6], secondsSince(start));
+
+                uint nFiltered = min<uint>(100, gsea.geneSetIds().size() - 1);
+                start = chrono::steady_clock::now();
+                gsea.filterResults(nFiltered, "", "filtered.csv");
+                best[7] = min(best[7], secondsSince(start));
+                filesystem::remove_all(gsea.chunksDirectory());
+            }
+        }
+
+        report("parse", size, nThreads, best[0], csvBytes / 1e6, "MB");
+        report("normalize", size, nThreads, best[1], bulkBytes / 1e6, "MB");
+        report("rank-counts", size, nThreads, best[2], size.nCells, "samples");
+        report("rank-floats", size, nThreads, best[3], size.nSamples, "samples");
+        report("score-bulk", size, nThreads, best[4], bulkScores, "ES");
+        report("score-scrna", size, nThreads, best[5], scRnaScores, "ES");
+        report("run-chunked", size, nThreads, best[6], scRnaScores, "ES");
+        report("filter-results", size, nThreads, best[7], scRnaScores * sizeof(float) / 1e6, "MB");
+    }
+}
+
+/**
+ * @brief Prints a check result line
+ * @param check check name
+ * @param size size preset
+ * @param nSamples samples compared
+ * @param difference largest difference found, relative for the scores and a count of mismatches otherwise
+ * @param tolerance largest difference accepted
+ * @return True if the check passed
+ */
+static bool reportCheck(const char *check, const BenchSize &size, uint nSamples, double difference, double tolerance)
+{
+    bool passed = difference <= tolerance;
+    printf("%-16s %-8s %7u %14.3g %s\n", check, size.name, nSamples, difference, passed ? "ok" : "FAILED");
+    fflush(stdout);
+    return passed;
+}
+
+/**
+ * @brief Relative difference of two scores
+ * @param value score
+ * @param reference reference score
+ * @param scale magnitude of the running sum terms of the score, see runningSumScale
+ * @return Difference relative to the reference, or to scale if it is larger
+ */
+static double scoreDifference(float value, float reference, double scale)
+{
+    if (not isfinite(value) or not isfinite(reference))
+        return value == reference ? 0 : INFINITY;
+    return fabs(double(value) - reference) / max({1.0, scale, fabs(double(reference))});
+}
+
+/**
+ * @brief Magnitude of the running sum terms, the ES is their difference and their rounding errors grow with them
+ * @param n number of ranked positions
+ * @param nHits number of hits
+ * @param posScore running sum increment of a hit
+ * @param negScore running sum increment of a miss
+ * @return Sum of the hit and miss terms at the last position
+ */
+static double runningSumScale(uint32_t n, uint32_t nHits, float posScore, float negScore)
+{
+    return nHits < n ? double(posScore) * nHits - double(negScore) * (n - nHits) : double(posScore) * nHits;
+}
+
+/**
+ * @brief Reference ranking, a comparator sort by decreasing count with ties broken by increasing gene
+ * @param counts counts of a sample
+ * @param nGenes number of genes
+ * @param order genes in rank order
+ */
+static void referenceRank(const float *counts, uint nGenes, vector<uint32_t> &order)
+{
+    order.resize(nGenes);
+    for (uint32_t i = 0; i < nGenes; ++i)
+        order[i] = i;
+    sort(order.begin(), order.end(), [counts](uint32_t a, uint32_t b)
+    {
+        return counts[a] > counts[b] or (counts[a] == counts[b] and a < b);
+    });
+}
+
+/**
+ * @brief Reference running sum maximum, a scalar pass over every position, see runningSumMax. The miss term is
+ * only added after a miss, so a gene set with every gene, whose negScore is infinite, scores 0 as in a running
+ * sum that adds the increments one by one.
+ * @pre n > 0
+ */
+static float referenceRunningSumMax(const uint8_t *hitMask, uint32_t n, float posScore, float negScore)
+{
+    float maxValue = -INFINITY;
+    uint32_t hits = 0;
+    for (uint32_t r = 0; r < n; ++r)
+    {
+        hits += hitMask[r];
+        float value = posScore * hits;
+        if (hits <= r)
+            value += negScore * (r + 1 - hits);
+        maxValue = max(maxValue, value);
+    }
+    return maxValue;
+}
+
+/**
+ * @brief Reference ES of the first samples of a matrix, with referenceRank and referenceRunningSumMax. The
+ * members of a gene set are the rows of its genes and a scRNA sample only ranks its non null counts, as in Gsea.
+ * @param matrix expression matrix
+ * @param nSamples samples to score
+ * @param geneIds gene ids of the matrix rows
+ * @param geneSets gene sets collection
+ * @param scRna true if the samples are scRNA cells
+ * @param geneSetIds ids of the gene sets with members in the matrix
+ * @param scales runningSumScale of every gene set over every gene
+ * @return ES of sample j and gene set k at [j][k]
+ */
+static vector<vector<float>> referenceScores(const ExprMatrix &matrix, uint nSamples, const vector<string> &geneIds,
+                                             const GeneSets &geneSets, bool scRna, vector<string> &geneSetIds,
+                                             vector<double> &scales)
+{
+    uint nGenes = geneIds.size();
+    unordered_map<string, vector<uint32_t>> geneRows;
+    for (uint32_t i = 0; i < nGenes; ++i)
+        geneRows[geneIds[i]].push_back(i);
+
+    vector<vector<uint32_t>> members;
+    geneSetIds.clear();
+    for (uint k = 0; k < geneSets.size(); ++k)
+    {
+        vector<uint32_t> rows;
+        for (uint32_t m = 0; m < geneSets.geneSetSize(k); ++m)
+        {
+            auto found = geneRows.find(geneSets.gene(geneSets.geneSet(k)[m]));
+            if (found != geneRows.end())
+                rows.insert(rows.end(), found->second.begin(), found->second.end());
+        }
+        if (rows.empty())
+            continue;
+        members.push_back(rows);
+        geneSetIds.push_back(geneSets.id(k));
+    }
+
+    scales.clear();
+    for (const vector<uint32_t> &rows : members)
+    {
+        float geneSetSize = rows.size();
+        scales.push_back(runningSumScale(nGenes, rows.size(), sqrt((nGenes - geneSetSize) / geneSetSize),
+                                         -sqrt((geneSetSize / (nGenes - geneSetSize)))));
+    }
+
+    vector<vector<float>> scores(nSamples, vector<float>(members.size()));
+    vector<uint32_t> order, ranks(nGenes);
+    vector<uint8_t> hitMask(nGenes);
+    for (uint j = 0; j < nSamples; ++j)
+    {
+        const float *counts = matrix.sample(j);
+        referenceRank(counts, nGenes, order);
+        uint32_t nRanked = nGenes;
+        while (scRna and nRanked > 0 and counts[order[nRanked - 1]] == 0)
+            --nRanked;
+        for (uint32_t r = 0; r < nGenes; ++r)
+            ranks[order[r]] = r;
+
+        for (uint k = 0; k < members.size(); ++k)
+        {
+            float geneSetSize = members[k].size();
+            float posScore = sqrt((nGenes - geneSetSize) / geneSetSize);
+            float negScore = -sqrt((geneSetSize / (nGenes - geneSetSize)));
+            for (uint32_t i : members[k])
+                hitMask[ranks[i]] = 1;
+            scores[j][k] = nRanked == 0 ? 0 : referenceRunningSumMax(hitMask.data(), nRanked, posScore, negScore);
+            for (uint32_t i : members[k])
+                hitMask[ranks[i]] = 0;
+        }
+    }
+    return scores;
+}
+
+/**
+ * @brief Reads a results csv file
+ * @param fileName results file, a header line with the column ids and then an id and the values of every row
+ * @param columnIds ids of the header line
+ * @param rowIds id of every row
+ * @return Values of every row
+ */
+static vector<vector<float>> readResults(const string &fileName, vector<string> &columnIds, vector<string> &rowIds)
+{
+    ifstream file(fileName);
+    string line, field;
+    vector<vector<float>> values;
+    getline(file, line);
+    stringstream ssHeader(line);
+    while (getline(ssHeader, field, ','))
+        columnIds.push_back(field);
+    while (getline(file, line))
+    {
+        stringstream ssLine(line);
+        getline(ssLine, field, ',');
+        rowIds.push_back(field);
+        values.emplace_back();
+        while (getline(ssLine, field, ','))
+            values.back().push_back(strtof(field.c_str(), nullptr));
+    }
+    return values;
+}
+
+/**
+ * @brief Largest difference between scores and their reference
+ * @param scores scores, at [j][k] if sampleMajor is true and at [k][j] otherwise
+ * @param ids ids of the rows of scores, compared with the sample or gene set ids of the reference
+ * @param reference reference scores at [j][k]
+ * @param referenceIds ids of the rows of scores expected
+ * @param scales runningSumScale of every gene set
+ * @param sampleMajor layout of scores
+ * @return Largest scoreDifference, infinity if the shapes or the ids differ
+ */
+static double maxScoreDifference(const vector<vector<float>> &scores, const vector<string> &ids,
+                                 const vector<vector<float>> &reference, const vector<string> &referenceIds,
+                                 const vector<double> &scales, bool sampleMajor)
+{
+    if (ids != referenceIds or scores.size() != ids.size())
+        return INFINITY;
+    double difference = 0;
+    for (uint j = 0; j < reference.size(); ++j)
+    {
+        for (uint k = 0; k < reference[j].size(); ++k)
+        {
+            uint row = sampleMajor ? j : k;
+            uint column = sampleMajor ? k : j;
+            if (column >= scores[row].size())
+                return INFINITY;
+            difference = max(difference, scoreDifference(scores[row][column], reference[j][k], scales[k]));
+        }
+    }
+    return difference;
+}
+
+/**
+ * @brief Number of mismatches between the ranking of every sample and referenceRank
+ * @param matrix expression matrix
+ * @param nSamples samples to rank
+ * @return Number of samples ranked differently
+ */
+static uint rankingMismatches(const ExprMatrix &matrix, uint nSamples)
+{
+    RankScratch scratch;
+    vector<uint32_t> order(matrix.nGenes), reference;
+    uint mismatches = 0;
+    for (uint j = 0; j < nSamples; ++j)
+    {
+        rankGenes(matrix.sample(j), matrix.nGenes, scratch, order.data());
+        referenceRank(matrix.sample(j), matrix.nGenes, reference);
+        mismatches += order != reference;
+    }
+    return mismatches;
+}
+
+/**
+ * @brief Runs every check of a size preset
+ * @param size size preset
+ * @param nThreads number of threads
+ * @return True if every check passed
+ */
+static bool runChecks(const BenchSize &size, uint nThreads)
+{
+    uint nSamples = min(checkSamples, size.nSamples);
+    uint nCells = min(checkSamples, size.nCells);
+    vector<string> geneIds = syntheticIds("G", size.nGenes);
+    vector<string> sampleIds = syntheticIds("S", nSamples);
+    vector<string> cellIds = syntheticIds("C", nCells);
+    // The generators fill the samples in order, so these are the first samples of the benchmarks
+    ExprMatrix bulkMatrix = syntheticBulkMatrix(nSamples, size.nGenes, 1);
+    ExprMatrix scRnaMatrix = syntheticScRnaMatrix(nCells, size.nGenes, scRnaDensity, 2);
+    GeneSets geneSets = syntheticGeneSets(size.nGeneSets, geneIds, 3);
+
+    // A gene set with every gene and some absent ones has no misses, its ES is 0 in every sample
+    vector<string_view> allGenes(geneIds.begin(), geneIds.end());
+    allGenes.push_back("ABSENT0");
+    allGenes.push_back("ABSENT1");
+    geneSets.add("ALL", allGenes);
+
+    ExprMatrix floatMatrix = copyMatrix(bulkMatrix);
+    for (uint j = 0; j < nSamples; ++j)
+    {
+        for (uint i = 0; i < size.nGenes; ++i)
+            floatMatrix.sample(j)[i] = log1p(floatMatrix.sample(j)[i]) - 2.5f;
+    }
+
+    printf("# size %s: genes=%u samples=%u cells=%u gene-sets=%u\n", size.name, size.nGenes, nSamples, nCells,
+           size.nGeneSets);
+    bool passed = true;
+
+    // Counting sort of the integer counts and radix sort of the floats
+    passed &= reportCheck("rank-counts", size, nCells, rankingMismatches(scRnaMatrix, nCells), 0);
+    passed &= reportCheck("rank-floats", size, nSamples, rankingMismatches(floatMatrix, nSamples), 0);
+
+    // Vector kernels on masks of every density, the lengths cover the partial vector blocks
+    mt19937_64 random(4);
+    vector<uint8_t> hitMask(size.nGenes + hitMaskPadding);
+    double kernelDifference = 0;
+    uint nMasks = 0;
+    for (uint32_t n : {1u, 7u, 15u, 16u, 17u, 63u, 64u, 65u, 1000u, size.nGenes})
+    {
+        for (uint32_t nHits : {1u, 5u, n / 10 + 1, n / 2 + 1, n})
+        {
+            nHits = min(nHits, n);
+            fill(hitMask.begin(), hitMask.end(), 0);
+            for (uint32_t h = 0; h < nHits; ++h)
+                hitMask[random() % n] = 1;
+            float posScore = sqrt(float(size.nGenes - nHits) / nHits);
+            float negScore = -sqrt(float(nHits) / (size.nGenes - nHits + 1));
+            uint32_t nMaskHits = count(hitMask.begin(), hitMask.begin() + n, 1);
+            kernelDifference = max(kernelDifference,
+                                   scoreDifference(runningSumMax(hitMask.data(), n, posScore, negScore),
+                                                   referenceRunningSumMax(hitMask.data(), n, posScore, negScore),
+                                                   runningSumScale(n, nMaskHits, posScore, negScore)));
+            ++nMasks;
+        }
+    }
+    passed &= reportCheck("running-sum", size, nMasks, kernelDifference, checkTolerance);
+
+    vector<string> bulkGeneSetIds, scRnaGeneSetIds;
+    vector<double> scales, csvScales;
+    vector<vector<float>> bulkReference = referenceScores(bulkMatrix, nSamples, geneIds, geneSets, false, bulkGeneSetIds,
+                                                          scales);
+    vector<vector<float>> scRnaReference = referenceScores(scRnaMatrix, nCells, geneIds, geneSets, true, scRnaGeneSetIds,
+                                                           scales);
+
+    double difference;
+    {
+        QuietCout quiet;
+        Gsea gsea(geneSets, bulkMatrix, geneIds, sampleIds, nThreads, false);
+        gsea.run("", 0);
+        difference = maxScoreDifference(gsea.scores(), gsea.geneSetIds(), bulkReference, bulkGeneSetIds, scales, false);
+    }
+    passed &= reportCheck("score-bulk", size, nSamples, difference, checkTolerance);
+
+    {
+        QuietCout quiet;
+        Gsea gsea(cellIds, geneIds, geneSets, nThreads);
+        gsea.setWriteScores(false);
+        gsea.runChunked(scRnaMatrix);
+        difference = gsea.geneSetIds() == scRnaGeneSetIds ?
+                     maxScoreDifference(gsea.scores(), cellIds, scRnaReference, cellIds, scales, true) : INFINITY;
+    }
+    passed &= reportCheck("score-scrna", size, nCells, difference, checkTolerance);
+
+    // The results are written with the default precision of an ostream
+    uint nMismatches = 0;
+    RowBuffer buffer(',', 6);
+    for (const vector<float> &row : scRnaReference)
+    {
+        buffer.clear();
+        buffer.appendValues(row.data(), row.size());
+        ostringstream expected;
+        for (float value : row)
+            expected << ',' << value;
+        nMismatches += buffer.str() != expected.str();
+    }
+    passed &= reportCheck("write-format", size, nCells, nMismatches, 0);
+
+    // Gsea() drops the null rows of a bulk matrix
+    vector<uint32_t> rows;
+    for (uint32_t i = 0; i < size.nGenes; ++i)
+    {
+        bool nullRow = true;
+        for (uint j = 0; j < nSamples; ++j)
+            nullRow = nullRow and bulkMatrix.sample(j)[i] == 0;
+        if (not nullRow)
+            rows.push_back(i);
+    }
+    ExprMatrix nonNullMatrix(nSamples, rows.size());
+    vector<string> nonNullIds;
+    for (uint32_t i : rows)
+        nonNullIds.push_back(geneIds[i]);
+    for (uint j = 0; j < nSamples; ++j)
+    {
+        for (uint32_t r = 0; r < rows.size(); ++r)
+            nonNullMatrix.sample(j)[r] = bulkMatrix.sample(j)[rows[r]];
+    }
+    vector<string> csvGeneSetIds, columnIds, rowIds;
+    vector<vector<float>> csvReference = referenceScores(nonNullMatrix, nSamples, nonNullIds, geneSets, false,
+                                                         csvGeneSetIds, csvScales);
+    writeBulkCsv("expression-matrix.csv", bulkMatrix, geneIds, sampleIds);
+    writeScRnaCsv("scrna-matrix.csv", scRnaMatrix, geneIds, cellIds);
+    writeGeneSetsCsv("gene-sets.csv", geneSets);
+    {
+        QuietCout quiet;
+        writeConfig(nThreads);
+        Gsea gsea;
+        gsea.run("", 0);
+    }
+    vector<vector<float>> results = readResults("results.csv", columnIds, rowIds);
+    difference = columnIds == sampleIds ? maxScoreDifference(results, rowIds, csvReference, csvGeneSetIds, csvScales, false) :
+                 INFINITY;
+    passed &= reportCheck("csv-bulk", size, nSamples, difference, csvTolerance);
+
+    {
+        QuietCout quiet;
+        writeConfig(nThreads, true);
+        Gsea gsea;
+        gsea.run("", 0);
+    }
+    columnIds.clear();
+    rowIds.clear();
+    results = readResults("results.csv", columnIds, rowIds);
+    difference = columnIds == scRnaGeneSetIds ? maxScoreDifference(results, rowIds, scRnaReference, cellIds, scales, true) :
+                 INFINITY;
+    passed &= reportCheck("csv-scrna", size, nCells, difference, csvTolerance);
+    return passed;
+}
+
+/**
+ * @brief Writes the synthetic data of the benchmarks
+ * @param argc number of arguments
+ * @param argv arguments, see the usage
+ * @return Exit status
+ */
+static int generate(int argc, char *argv[])
+{
+    if (argc < 7)
+    {
+        cerr << "Usage: " << argv[0] << " --generate folder genes samples cells gene-sets [seed]" << endl;
+        return EXIT_FAILURE;
+    }
+    filesystem::path folder = argv[2];
+    uint nGenes = stoul(argv[3]);
+    uint nSamples = stoul(argv[4]);
+    uint nCells = stoul(argv[5]);
+    uint nGeneSets = stoul(argv[6]);
+    uint64_t seed = argc > 7 ? stoull(argv[7]) : 1;
+
+    filesystem::create_directories(folder);
+    vector<string> geneIds = syntheticIds("G", nGenes);
+    bool written = writeBulkCsv((folder / "expression-matrix.csv").string(),
+                                syntheticBulkMatrix(nSamples, nGenes, seed), geneIds, syntheticIds("S", nSamples)) and
+                   writeScRnaCsv((folder / "scrna-matrix.csv").string(),
+                                 syntheticScRnaMatrix(nCells, nGenes, scRnaDensity, seed + 1), geneIds, syntheticIds("C", nCells)) and
+                   writeGeneSetsCsv((folder / "gene-sets.csv").string(), syntheticGeneSets(nGeneSets, geneIds, seed + 2));
+    if (not written)
+    {
+        cerr << "[ERROR] the synthetic data could not be written in " << folder.string() << endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 and string(argv[1]) == "--generate")
+        return generate(argc, argv);
+
+    // The size and the threads follow --check
+    bool check = argc > 1 and string(argv[1]) == "--check";
+    int first = check ? 2 : 1;
+
+    vector<const BenchSize *> sizes;
+    stringstream sizeNames(argc > first ? argv[first] : "small");
+    string sizeName;
+    while (getline(sizeNames, sizeName, ','))
+    {
+        uint nSizes = sizes.size();
+        for (const BenchSize &benchSize : benchSizes)
+        {
+            if (sizeName == benchSize.name or sizeName == "all")
+                sizes.push_back(&benchSize);
+        }
+        if (sizes.size() == nSizes)
+        {
+            cerr << "Usage: " << argv[0] << " [--check] [small|medium|large|all][,...] [max threads]" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint maxThreads = argc > first + 1 ? stoul(argv[first + 1]) : max(1u, thread::hardware_concurrency());
+    vector<uint> threadCounts;
+    for (uint nThreads = 1; nThreads < maxThreads; nThreads *= 2)
+        threadCounts.push_back(nThreads);
+    threadCounts.push_back(maxThreads);
+
+    // Gsea() reads gsea.config and filterResults writes var in the current folder
+    filesystem::path benchFolder = filesystem::temp_directory_path() / ("gsea-bench-" + to_string(getpid()));
+    filesystem::create_directories(benchFolder);
+    filesystem::current_path(benchFolder);
+
+    bool passed = true;
+    printf("# gsea-bench 1\n");
+    if (check)
+    {
+        printf("# %-14s %-8s %7s %14s %s\n", "check", "size", "samples", "max-difference", "status");
+        for (const BenchSize *size : sizes)
+            passed &= runChecks(*size, maxThreads);
+    }
+    else
+    {
+        printf("# %-14s %-8s %7s %12s %14s %s\n", "benchmark", "size", "threads", "seconds", "throughput", "unit");
+        for (const BenchSize *size : sizes)
+            runBenchmarks(*size, threadCounts);
+    }
+
+    filesystem::current_path(filesystem::temp_directory_path());
+    filesystem::remove_all(benchFolder);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
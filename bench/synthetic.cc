@@ -0,0 +1,219 @@
+/** @file synthetic.cc
+ * @brief Synthetic data generator implementation file */
+
+#include "synthetic.hh"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <string_view>
+
+uint64_t SyntheticRng::next()
+{
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+double SyntheticRng::uniform()
+{
+    return (next() >> 11) * 0x1.0p-53;
+}
+
+double SyntheticRng::normal()
+{
+    // 1 - uniform() is in (0, 1], so the logarithm is finite
+    double radius = sqrt(-2 * log(1 - uniform()));
+    return radius * cos(2 * M_PI * uniform());
+}
+
+uint32_t SyntheticRng::below(uint32_t n)
+{
+    return (next() >> 32) * n >> 32;
+}
+
+vector<string> syntheticIds(const string &prefix, uint n)
+{
+    vector<string> ids = vector<string>(n);
+    for (uint i = 0; i < n; ++i)
+        ids[i] = prefix + to_string(i);
+    return ids;
+}
+
+/**
+ * @brief Random permutation of [0, n), with the Fisher-Yates shuffle
+ * @param n number of elements
+ * @param rng generator
+ * @return Permutation
+ */
+static vector<uint32_t> permutation(uint n, SyntheticRng &rng)
+{
+    vector<uint32_t> order = vector<uint32_t>(n);
+    iota(order.begin(), order.end(), 0);
+    for (uint i = n; i > 1; --i)
+        swap(order[i - 1], order[rng.below(i)]);
+    return order;
+}
+
+ExprMatrix syntheticBulkMatrix(uint nSamples, uint nGenes, uint64_t seed)
+{
+    SyntheticRng rng(seed);
+    vector<double> geneLogMeans = vector<double>(nGenes);
+    for (uint i = 0; i < nGenes; ++i)
+        geneLogMeans[i] = 2 + 1.8 * rng.normal();
+
+    ExprMatrix matrix(nSamples, nGenes);
+    for (uint j = 0; j < nSamples; ++j)
+    {
+        double logLibrarySize = 0.25 * rng.normal();
+        float *sample = matrix.sample(j);
+        for (uint i = 0; i < nGenes; ++i)
+            sample[i] = round(exp(geneLogMeans[i] + logLibrarySize + 0.4 * rng.normal() - 0.08));
+    }
+    return matrix;
+}
+
+ExprMatrix syntheticScRnaMatrix(uint nCells, uint nGenes, double density, uint64_t seed)
+{
+    SyntheticRng rng(seed);
+
+    // Detection probability decaying with the popularity rank of the gene, scaled to the requested density
+    vector<uint32_t> ranks = permutation(nGenes, rng);
+    vector<double> detection = vector<double>(nGenes);
+    double scale = max(1.0, 0.05 * nGenes);
+    for (uint i = 0; i < nGenes; ++i)
+        detection[i] = 1 / (1 + ranks[i] / scale);
+    double meanDetection = accumulate(detection.begin(), detection.end(), 0.0) / max(1u, nGenes);
+    for (double &p : detection)
+        p *= density / meanDetection;
+
+    ExprMatrix matrix(nCells, nGenes);
+    for (uint j = 0; j < nCells; ++j)
+    {
+        double librarySize = exp(0.5 * rng.normal() - 0.125);
+        float *cell = matrix.sample(j);
+        for (uint i = 0; i < nGenes; ++i)
+        {
+            cell[i] = 0;
+            if (rng.uniform() < min(0.95, detection[i] * librarySize))
+            {
+                uint count = 1;
+                while (count < 1000 and rng.uniform() < 0.5)
+                    ++count;
+                cell[i] = count;
+            }
+        }
+    }
+    return matrix;
+}
+
+GeneSets syntheticGeneSets(uint nGeneSets, const vector<string> &geneIds, uint64_t seed)
+{
+    SyntheticRng rng(seed);
+    uint nGenes = geneIds.size();
+    vector<uint32_t> popularity = permutation(nGenes, rng);
+
+    GeneSets geneSets;
+    vector<string> members;
+    vector<string_view> memberViews;
+    for (uint k = 0; k < nGeneSets; ++k)
+    {
+        uint size = exp(log(15.0) + rng.uniform() * (log(500.0) - log(15.0)));
+        size = min(size, nGenes);
+        members.clear();
+        for (uint m = 0; m < size; ++m)
+        {
+            if (rng.uniform() < 0.05)
+                members.push_back("X" + to_string(rng.below(nGenes)));
+            else
+            {
+                double u = rng.uniform();
+                members.push_back(geneIds[popularity[uint(nGenes * u * u * u)]]);
+            }
+        }
+        memberViews.assign(members.begin(), members.end());
+        geneSets.add("SET" + to_string(k), memberViews);
+    }
+    return geneSets;
+}
+
+/**
+ * @brief Appends the integer counts of a row to a line, each one preceded by a comma
+ * @param line line of the csv
+ * @param counts counts of the row
+ * @param stride distance between two consecutive counts
+ * @param n number of counts
+ */
+static void appendCounts(string &line, const float *counts, size_t stride, uint n)
+{
+    char digits[16];
+    for (uint i = 0; i < n; ++i)
+    {
+        digits[0] = ',';
+        to_chars_result end = to_chars(digits + 1, digits + sizeof(digits), uint32_t(counts[i * stride]));
+        line.append(digits, end.ptr);
+    }
+}
+
+/**
+ * @brief Writes a line of ids separated by commas
+ * @param file csv file
+ * @param ids ids
+ */
+static void writeIds(ofstream &file, const vector<string> &ids)
+{
+    for (uint i = 0; i < ids.size(); ++i)
+        file << (i == 0 ? "" : ",") << ids[i];
+    file << '\n';
+}
+
+bool writeBulkCsv(const string &fileName, const ExprMatrix &matrix, const vector<string> &geneIds,
+                  const vector<string> &sampleIds)
+{
+    ofstream file(fileName, ios::binary);
+    writeIds(file, sampleIds);
+    string line;
+    for (uint i = 0; i < matrix.nGenes; ++i)
+    {
+        line = geneIds[i];
+        appendCounts(line, matrix.data + i, matrix.stride, matrix.nSamples);
+        line += '\n';
+        file.write(line.data(), line.size());
+    }
+    file.close();
+    return not file.fail();
+}
+
+bool writeScRnaCsv(const string &fileName, const ExprMatrix &matrix, const vector<string> &geneIds,
+                   const vector<string> &cellIds)
+{
+    ofstream file(fileName, ios::binary);
+    writeIds(file, geneIds);
+    string line;
+    for (uint j = 0; j < matrix.nSamples; ++j)
+    {
+        line = cellIds[j];
+        appendCounts(line, matrix.sample(j), 1, matrix.nGenes);
+        line += '\n';
+        file.write(line.data(), line.size());
+    }
+    file.close();
+    return not file.fail();
+}
+
+bool writeGeneSetsCsv(const string &fileName, const GeneSets &geneSets)
+{
+    ofstream file(fileName, ios::binary);
+    for (uint k = 0; k < geneSets.size(); ++k)
+    {
+        file << geneSets.id(k);
+        const uint32_t *members = geneSets.geneSet(k);
+        for (uint32_t m = 0; m < geneSets.geneSetSize(k); ++m)
+            file << ',' << geneSets.gene(members[m]);
+        file << '\n';
+    }
+    file.close();
+    return not file.fail();
+}
@@ -0,0 +1,129 @@
+/** @file synthetic.hh
+ * @brief Synthetic data generator header file
+ *
+ * Every generator is deterministic: the same sizes and seed produce the same data on every platform, since the
+ * random numbers come from SyntheticRng instead of the implementation-defined standard distributions. */
+
+#ifndef SYNTHETIC_HH
+#define SYNTHETIC_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "exprmatrix.hh"
+#include "genesets.hh"
+
+using namespace std;
+
+/** @class SyntheticRng
+ * @brief splitmix64 pseudo-random generator */
+class SyntheticRng
+{
+private:
+    uint64_t state;
+
+public:
+    /**
+    * @brief Creates a generator
+    * @param seed seed of the sequence
+    */
+    explicit SyntheticRng(uint64_t seed) : state(seed) {}
+
+    /**
+    * @brief Next number of the sequence
+    * @return Uniform 64 bit number
+    */
+    uint64_t next();
+
+    /**
+    * @brief Uniform number in [0, 1)
+    * @return Uniform double with 53 random bits
+    */
+    double uniform();
+
+    /**
+    * @brief Standard normal number, with the Box-Muller transform
+    * @return Normal double with mean 0 and variance 1
+    */
+    double normal();
+
+    /**
+    * @brief Uniform integer in [0, n)
+    * @param n number of values
+    * @pre n > 0
+    * @return Uniform integer
+    */
+    uint32_t below(uint32_t n);
+};
+
+/**
+ * @brief Ids made of a prefix and a counter
+ * @param prefix prefix of the ids
+ * @param n number of ids
+ * @return prefix0, prefix1, ..., prefix(n - 1)
+ */
+vector<string> syntheticIds(const string &prefix, uint n);
+
+/**
+ * @brief Bulk RNA-seq read counts: every gene has a log-normal mean expression, so a few genes take most of
+ * the reads, every sample a log-normal library size, and every count log-normal noise around its mean
+ * @param nSamples number of samples
+ * @param nGenes number of genes
+ * @param seed generator seed
+ * @return nSamples x nGenes matrix of non-negative integer counts
+ */
+ExprMatrix syntheticBulkMatrix(uint nSamples, uint nGenes, uint64_t seed);
+
+/**
+ * @brief scRNA UMI counts: every gene is detected with a probability that decays with its popularity rank and
+ * the detected counts are small geometric integers, so most counts are null
+ * @param nCells number of cells
+ * @param nGenes number of genes
+ * @param density average fraction of non null counts
+ * @param seed generator seed
+ * @return nCells x nGenes matrix of non-negative integer counts
+ */
+ExprMatrix syntheticScRnaMatrix(uint nCells, uint nGenes, double density, uint64_t seed);
+
+/**
+ * @brief Gene set collection shaped like the curated collections: sizes are log-uniform between 15 and 500,
+ * members are drawn with a power law over the genes so the popular ones are shared by many gene sets, and
+ * about 5% of the members are ids outside the gene universe
+ * @param nGeneSets number of gene sets
+ * @param geneIds gene universe
+ * @param seed generator seed
+ * @return Gene sets named SET0, SET1, ...
+ */
+GeneSets syntheticGeneSets(uint nGeneSets, const vector<string> &geneIds, uint64_t seed);
+
+/**
+ * @brief Writes a bulk expression matrix csv, a row of sample ids followed by a row per gene
+ * @param fileName csv file name
+ * @param matrix counts, samples in the rows
+ * @param geneIds gene ids
+ * @param sampleIds sample ids
+ * @return False if the file could not be written, true otherwise
+ */
+bool writeBulkCsv(const string &fileName, const ExprMatrix &matrix, const vector<string> &geneIds,
+                  const vector<string> &sampleIds);
+
+/**
+ * @brief Writes a scRNA expression matrix csv, a row of gene ids followed by a row per cell
+ * @param fileName csv file name
+ * @param matrix counts, cells in the rows
+ * @param geneIds gene ids
+ * @param cellIds cell ids
+ * @return False if the file could not be written, true otherwise
+ */
+bool writeScRnaCsv(const string &fileName, const ExprMatrix &matrix, const vector<string> &geneIds,
+                   const vector<string> &cellIds);
+
+/**
+ * @brief Writes a gene sets csv, a row per gene set with its id followed by its genes
+ * @param fileName csv file name
+ * @param geneSets gene sets
+ * @return False if the file could not be written, true otherwise
+ */
+bool writeGeneSetsCsv(const string &fileName, const GeneSets &geneSets);
+
+#endif
@@ -0,0 +1,73 @@
+/** @file batchsizer.cc
+ * @brief BatchSizer implementation file */
+
+#include "batchsizer.hh"
+#include <algorithm>
+
+/// Most batches allocated by a plan
+static const uint maxDepth = 8;
+
+/// The first batches are filled with maxSamples / initialFraction samples
+static const uint initialFraction = 8;
+
+BatchPlan planBatches(ulong budgetBytes, ulong fixedBytes, ulong sampleBytes, uint minSamples, uint maxSamples,
+                      uint minDepth)
+{
+    BatchPlan plan;
+    ulong available = budgetBytes > fixedBytes ? budgetBytes - fixedBytes : 0;
+    ulong batchSamples = available / (ulong(minDepth) * sampleBytes);
+    plan.fits = batchSamples >= minSamples;
+    batchSamples = min<ulong>(max<ulong>(batchSamples, minSamples), maxSamples);
+    plan.maxSamples = max<ulong>(minSamples, batchSamples / minSamples * minSamples);
+
+    // The budget left by the largest useful batches lets more of them be in flight
+    plan.depth = minDepth;
+    if (plan.maxSamples + minSamples > maxSamples)
+        plan.depth = min<ulong>(maxDepth, max<ulong>(minDepth, available / (plan.maxSamples * sampleBytes)));
+
+    plan.initialSamples = max(minSamples, plan.maxSamples / initialFraction / minSamples * minSamples);
+    return plan;
+}
+
+BatchSizer::BatchSizer(uint samples) : samples(samples)
+{
+    reset(samples, samples);
+}
+
+void BatchSizer::reset(uint initialSamples, uint maxSamples)
+{
+    samples.store(initialSamples, memory_order_relaxed);
+    this->maxSamples = maxSamples;
+    previousSamples = 0;
+    previousThroughput = 0;
+    adapting = initialSamples < maxSamples;
+    warmedUp = false;
+}
+
+void BatchSizer::record(uint nSamples, double seconds)
+{
+    uint current = size();
+    if (not adapting or nSamples != current or seconds <= 0)
+        return;
+    if (not warmedUp)
+    {
+        warmedUp = true;
+        return;
+    }
+
+    double throughput = nSamples / seconds;
+    if (previousThroughput > 0 and throughput < previousThroughput * (1 + minGain))
+    {
+        if (throughput < previousThroughput)
+            samples.store(previousSamples, memory_order_relaxed);
+        adapting = false;
+        return;
+    }
+
+    previousSamples = current;
+    previousThroughput = throughput;
+    if (current == maxSamples)
+        adapting = false;
+    else
+        samples.store(min(maxSamples, 2 * current), memory_order_relaxed);
+}
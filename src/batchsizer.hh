@@ -0,0 +1,97 @@
+/** @file batchsizer.hh
+ * @brief BatchSizer header file
+ *
+ * With a memory budget, runScRna sizes its batches from the estimated bytes of a sample in flight (its expression
+ * row if it is parsed, its results row and its id) and the bytes held regardless of the batch size (the scratch
+ * buffers of the workers and the text of the writer). planBatches fits pipelineDepth batches of the largest size
+ * into the budget, and BatchSizer starts filling them with fewer samples and doubles the samples per batch while
+ * the measured scoring throughput keeps improving. runChunked uses the same sizer to recommend chunk sizes. */
+
+#ifndef BATCHSIZER_HH
+#define BATCHSIZER_HH
+
+#include <atomic>
+#include <sys/types.h>
+
+using namespace std;
+
+/** @struct BatchPlan
+ * @brief Batch sizes and number of batches in flight that fit in a memory budget */
+struct BatchPlan
+{
+    /// Samples allocated per batch, the largest batch size
+    uint maxSamples;
+    /// Samples of the first batches
+    uint initialSamples;
+    /// Number of batches allocated
+    uint depth;
+    /// False if the budget is below the minimum batches, which are used anyway
+    bool fits;
+};
+
+/**
+ * @brief Plans the batches of a memory budget
+ * @param budgetBytes memory budget
+ * @param fixedBytes bytes held regardless of the batch size
+ * @param sampleBytes bytes of every sample of a batch
+ * @param minSamples smallest batch, every batch size is a multiple of it
+ * @param maxSamples largest useful batch
+ * @param minDepth smallest number of batches, more are allocated while the largest batches fit in the budget
+ * @pre sampleBytes > 0, 0 < minSamples <= maxSamples, minDepth > 0
+ * @return Plan with depth batches of maxSamples samples at most, within the budget if it fits
+ */
+BatchPlan planBatches(ulong budgetBytes, ulong fixedBytes, ulong sampleBytes, uint minSamples, uint maxSamples,
+                      uint minDepth);
+
+/** @class BatchSizer
+ * @brief Number of samples per batch, doubled while the throughput of full batches improves. size() may be read by
+ * a thread while another one calls record(). */
+class BatchSizer
+{
+private:
+    atomic<uint> samples;
+    uint maxSamples;
+    /// Size before the last doubling and its throughput in samples per second, 0 before the first measure
+    uint previousSamples;
+    double previousThroughput;
+    /// False once the size is settled
+    bool adapting;
+    /// True once a batch has been measured, the first one is discarded as it pays the first touch of the buffers
+    bool warmedUp;
+
+public:
+    /**
+    * @brief Creates a sizer of batches of a fixed size
+    * @param samples samples per batch
+    */
+    explicit BatchSizer(uint samples = 0);
+
+    /**
+    * @brief Restarts the sizer
+    * @param initialSamples samples of the first batches
+    * @param maxSamples largest size, the size is fixed if it equals initialSamples
+    * @pre initialSamples <= maxSamples
+    */
+    void reset(uint initialSamples, uint maxSamples);
+
+    /**
+    * @brief Current batch size
+    * @return Samples of the next batch
+    */
+    uint size() const { return samples.load(memory_order_relaxed); }
+
+    /**
+    * @brief Measures a batch. Batches of a size different from size() are ignored, as the last one and the
+    * batches filled before the size changed.
+    * @param nSamples samples of the batch
+    * @param seconds time to process the batch
+    * @post size() is doubled if the throughput improved by minGain since the previous doubling, or settled to
+    * the best size measured otherwise
+    */
+    void record(uint nSamples, double seconds);
+
+    /// Relative throughput improvement that keeps doubling the size
+    static constexpr double minGain = 0.05;
+};
+
+#endif
@@ -0,0 +1,85 @@
+/** @file boundedqueue.hh
+ * @brief BoundedQueue header file */
+
+#ifndef BOUNDEDQUEUE_HH
+#define BOUNDEDQUEUE_HH
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <queue>
+
+using namespace std;
+
+/** @class BoundedQueue
+ * @brief Blocking FIFO queue with a maximum number of elements, used to connect pipeline stages */
+template <typename T>
+class BoundedQueue
+{
+private:
+    queue<T> items;
+    size_t capacity;
+    /// True when no more elements will be pushed
+    bool closed;
+    mutex itemsMutex;
+    condition_variable notEmpty;
+    condition_variable notFull;
+
+public:
+    /**
+    * @brief BoundedQueue creator function
+    * @param capacity maximum number of elements in the queue
+    */
+    BoundedQueue(size_t capacity)
+    {
+        this->capacity = capacity;
+        closed = false;
+    }
+
+    /**
+    * @brief Pushes an element, waiting while the queue is full
+    * @param item element to push
+    * @return False if the queue is closed and item was not pushed, true otherwise
+    */
+    bool push(T item)
+    {
+        unique_lock<mutex> lock(itemsMutex);
+        notFull.wait(lock, [this] { return items.size() < capacity or closed; });
+        if (closed)
+            return false;
+        items.push(move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /**
+    * @brief Pops the oldest element, waiting while the queue is empty and not closed
+    * @param item popped element
+    * @return False if the queue is closed and empty, true otherwise
+    */
+    bool pop(T &item)
+    {
+        unique_lock<mutex> lock(itemsMutex);
+        notEmpty.wait(lock, [this] { return not items.empty() or closed; });
+        if (items.empty())
+            return false;
+        item = move(items.front());
+        items.pop();
+        notFull.notify_one();
+        return true;
+    }
+
+    /**
+    * @brief Closes the queue, the elements already pushed can still be popped
+    * @post Waiting push and pop calls return
+    */
+    void close()
+    {
+        lock_guard<mutex> lock(itemsMutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+#endif
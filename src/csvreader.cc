@@ -0,0 +1,184 @@
+/** @file csvreader.cc
+ * @brief CsvReader implementation file */
+
+#include "csvreader.hh"
+#include <charconv>
+#include <cstring>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CsvReader::CsvReader(const string &fileName)
+{
+    data = nullptr;
+    size = 0;
+    cursor = 0;
+    opened = false;
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == 0)
+    {
+        opened = true;
+        if (fileStat.st_size > 0)
+        {
+            void *mapping = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+                opened = false;
+            else
+            {
+                madvise(mapping, fileStat.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char *>(mapping);
+                size = fileStat.st_size;
+            }
+        }
+    }
+    close(fd);
+}
+
+bool CsvReader::isOpen() const
+{
+    return opened;
+}
+
+bool CsvReader::readLine(string_view &line)
+{
+    return readLine(cursor, size, line);
+}
+
+bool CsvReader::readLine(size_t &offset, size_t end, string_view &line) const
+{
+    if (offset >= end or offset >= size)
+        return false;
+
+    const char *start = data + offset;
+    const char *newline = static_cast<const char *>(memchr(start, '\n', size - offset));
+    size_t length = newline == nullptr ? size - offset : newline - start;
+    offset += length + 1;
+
+    if (length > 0 and start[length - 1] == '\r')
+        --length;
+    line = string_view(start, length);
+    return true;
+}
+
+size_t CsvReader::lineStart(size_t offset) const
+{
+    if (offset == 0)
+        return 0;
+    if (offset >= size)
+        return size;
+
+    const char *newline = static_cast<const char *>(memchr(data + offset - 1, '\n', size - offset + 1));
+    return newline == nullptr ? size : newline - data + 1;
+}
+
+size_t CsvReader::position() const
+{
+    return cursor;
+}
+
+size_t CsvReader::fileSize() const
+{
+    return size;
+}
+
+bool CsvReader::nextField(string_view &line, string_view &field, char sep)
+{
+    if (line.empty())
+        return false;
+
+    size_t pos = line.find(sep);
+    if (pos == string_view::npos)
+    {
+        field = line;
+        line = string_view();
+    }
+    else
+    {
+        field = line.substr(0, pos);
+        line.remove_prefix(pos + 1);
+    }
+    return true;
+}
+
+bool CsvReader::nextWord(string_view &line, string_view &word)
+{
+    size_t start = line.find_first_not_of(" \t");
+    if (start == string_view::npos)
+    {
+        line = string_view();
+        return false;
+    }
+
+    size_t end = line.find_first_of(" \t", start);
+    if (end == string_view::npos)
+        end = line.size();
+    word = line.substr(start, end - start);
+    line.remove_prefix(end);
+    return true;
+}
+
+/**
+ * @brief Skips the characters std::from_chars does not accept but stof does
+ * @param first first character of the field
+ * @param last end of the field
+ * @return First character of the number
+ */
+static const char *skipNumberPrefix(const char *first, const char *last)
+{
+    while (first != last and (*first == ' ' or *first == '\t'))
+        ++first;
+    if (first != last and *first == '+')
+        ++first;
+    return first;
+}
+
+/**
+ * @brief Converts a field with std::from_chars
+ * @param field field to convert
+ * @param value field value, 0 if it is not a number
+ * @return False if the field is not a number followed by blanks only, true otherwise
+ */
+template <typename T>
+static bool parseNumber(string_view field, T &value)
+{
+    const char *last = field.data() + field.size();
+    value = 0;
+    from_chars_result result = from_chars(skipNumberPrefix(field.data(), last), last, value);
+    if (result.ec != errc())
+    {
+        value = 0;
+        return false;
+    }
+    const char *end = result.ptr;
+    while (end != last and (*end == ' ' or *end == '\t'))
+        ++end;
+    return end == last;
+}
+
+bool CsvReader::parseUInt(string_view field, uint64_t &value)
+{
+    return parseNumber(field, value);
+}
+
+bool CsvReader::parseFloat(string_view field, float &value)
+{
+    return parseNumber(field, value);
+}
+
+bool CsvReader::parseDouble(string_view field, double &value)
+{
+    return parseNumber(field, value);
+}
+
+CsvReader::~CsvReader()
+{
+    if (data != nullptr)
+        munmap(const_cast<char *>(data), size);
+}
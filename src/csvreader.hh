@@ -0,0 +1,130 @@
+/** @file csvreader.hh
+ * @brief CsvReader header file */
+
+#ifndef CSVREADER_HH
+#define CSVREADER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+/** @class CsvReader
+ * @brief Reads csv/tsv files through a read-only memory mapping, lines and fields are returned as
+ * views into the mapping so no string is allocated while parsing */
+class CsvReader
+{
+private:
+    /// First byte of the mapped file, nullptr if the file is empty or could not be opened
+    const char *data;
+    /// Size in bytes of the mapped file
+    size_t size;
+    /// Offset of the next line to be read
+    size_t cursor;
+    /// True if the file could be opened
+    bool opened;
+
+public:
+    /**
+    * @brief Maps the file fileName
+    * @param fileName csv file name
+    * @post The reader is positioned at the first line, isOpen() is false if the file could not be opened
+    */
+    CsvReader(const string &fileName);
+
+    CsvReader(const CsvReader &) = delete;
+    CsvReader &operator=(const CsvReader &) = delete;
+
+    /**
+    * @brief Checks if the file was opened
+    * @return True if the file could be opened, false otherwise
+    */
+    bool isOpen() const;
+
+    /**
+    * @brief Reads the next line, without the line terminator ("\n" or "\r\n")
+    * @param line view of the line, valid while the reader exists
+    * @return False if there are no more lines, true otherwise
+    */
+    bool readLine(string_view &line);
+
+    /**
+    * @brief Reads the line starting at offset, it does not modify the reader so it can be
+    * used concurrently to parse different byte ranges of the file
+    * @param offset offset of the line, it is moved to the start of the next line
+    * @param end end of the byte range, lines starting at or after it are not read
+    * @param line view of the line, valid while the reader exists
+    * @return False if offset is at or after end, true otherwise
+    */
+    bool readLine(size_t &offset, size_t end, string_view &line) const;
+
+    /**
+    * @brief Aligns an offset to the start of a line
+    * @param offset offset in the file
+    * @return Offset of the first line starting at or after offset
+    */
+    size_t lineStart(size_t offset) const;
+
+    /**
+    * @brief Offset of the next line read by readLine(line)
+    * @return Offset in bytes from the start of the file
+    */
+    size_t position() const;
+
+    /**
+    * @brief Size of the file
+    * @return Size in bytes of the file
+    */
+    size_t fileSize() const;
+
+    /**
+    * @brief Pops the first field of a line, it behaves like getline on a stringstream: a trailing
+    * separator does not produce an extra empty field
+    * @param line remaining fields of the line, the popped field and its separator are removed
+    * @param field view of the popped field
+    * @param sep field separator
+    * @return False if line has no more fields, true otherwise
+    */
+    static bool nextField(string_view &line, string_view &field, char sep);
+
+    /**
+    * @brief Pops the first word of a line, words are separated by runs of spaces or tabs
+    * @param line remaining words of the line, the popped word and the blanks around it are removed
+    * @param word view of the popped word
+    * @return False if line has no more words, true otherwise
+    */
+    static bool nextWord(string_view &line, string_view &word);
+
+    /**
+    * @brief Converts a field to an unsigned integer with std::from_chars, leading and trailing spaces and a
+    * leading '+' are skipped
+    * @param field field to convert
+    * @param value field value, 0 if it is not a number
+    * @return False if the field is empty, is not a number or has other characters after it, true otherwise
+    */
+    static bool parseUInt(string_view field, uint64_t &value);
+
+    /**
+    * @brief Converts a field to float with std::from_chars, leading and trailing spaces and a leading '+' are
+    * skipped
+    * @param field field to convert
+    * @param value field value, 0 if it is not a number
+    * @return False if the field is empty, is not a number or has other characters after it, true otherwise
+    */
+    static bool parseFloat(string_view field, float &value);
+
+    /**
+    * @brief Converts a field to double with std::from_chars, leading and trailing spaces and a leading '+' are
+    * skipped
+    * @param field field to convert
+    * @param value field value, 0 if it is not a number
+    * @return False if the field is empty, is not a number or has other characters after it, true otherwise
+    */
+    static bool parseDouble(string_view field, double &value);
+
+    ~CsvReader();
+};
+
+#endif
@@ -0,0 +1,139 @@
+/** @file eskernel.cc
+ * @brief Dense ES kernel implementation file */
+
+#include "eskernel.hh"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ESKERNEL_X86
+#endif
+
+/**
+ * @brief Scalar running sum maximum, see runningSumMax
+ */
+static float runningSumMaxScalar(const uint8_t *hitMask, uint32_t n, float posScore, float negScore)
+{
+    float maxValue = -INFINITY;
+    uint32_t hits = 0;
+    for (uint32_t r = 0; r < n; ++r)
+    {
+        hits += hitMask[r];
+        float value = posScore * hits + negScore * (r + 1 - hits);
+        maxValue = max(value, maxValue);
+    }
+    return maxValue;
+}
+
+#ifdef ESKERNEL_X86
+/**
+ * @brief AVX2 running sum maximum, see runningSumMax. Positions past n are misses, so the running sum
+ * only decreases there and the last block can be processed whole.
+ */
+__attribute__((target("avx2"))) static float runningSumMaxAvx2(const uint8_t *hitMask, uint32_t n, float posScore, float negScore)
+{
+    const __m256 pos = _mm256_set1_ps(posScore);
+    const __m256 neg = _mm256_set1_ps(negScore);
+    const __m256i lastLane = _mm256_set1_epi32(7);
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i positions = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8);
+    __m256i hitsBefore = _mm256_setzero_si256();
+    __m256 maxValues = _mm256_set1_ps(-INFINITY);
+    for (uint32_t r = 0; r < n; r += 8)
+    {
+        __m256i hits = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(hitMask + r)));
+        // Prefix sum inside each 128 bit lane, then the low lane total is added to the high lane
+        hits = _mm256_add_epi32(hits, _mm256_slli_si256(hits, 4));
+        hits = _mm256_add_epi32(hits, _mm256_slli_si256(hits, 8));
+        __m256i lowTotal = _mm256_shuffle_epi32(_mm256_permute2x128_si256(hits, hits, 0x08), 0xFF);
+        hits = _mm256_add_epi32(_mm256_add_epi32(hits, lowTotal), hitsBefore);
+
+        __m256i misses = _mm256_sub_epi32(positions, hits);
+        __m256 values = _mm256_add_ps(_mm256_mul_ps(pos, _mm256_cvtepi32_ps(hits)),
+                                      _mm256_mul_ps(neg, _mm256_cvtepi32_ps(misses)));
+        maxValues = _mm256_max_ps(maxValues, values);
+
+        hitsBefore = _mm256_permutevar8x32_epi32(hits, lastLane);
+        positions = _mm256_add_epi32(positions, step);
+    }
+
+    __m128 half = _mm_max_ps(_mm256_castps256_ps128(maxValues), _mm256_extractf128_ps(maxValues, 1));
+    half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+}
+
+// GCC 12 warns about the undefined vectors used inside its own AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/**
+ * @brief AVX-512 running sum maximum, see runningSumMax and runningSumMaxAvx2
+ */
+__attribute__((target("avx512f"))) static float runningSumMaxAvx512(const uint8_t *hitMask, uint32_t n, float posScore, float negScore)
+{
+    const __m512 pos = _mm512_set1_ps(posScore);
+    const __m512 neg = _mm512_set1_ps(negScore);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i lastLane = _mm512_set1_epi32(15);
+    const __m512i step = _mm512_set1_epi32(16);
+    __m512i positions = _mm512_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+    __m512i hitsBefore = zero;
+    __m512 maxValues = _mm512_set1_ps(-INFINITY);
+    for (uint32_t r = 0; r < n; r += 16)
+    {
+        __m512i hits = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hitMask + r)));
+        // Prefix sum by adding the vector shifted up by 1, 2, 4 and 8 lanes
+        hits = _mm512_add_epi32(hits, _mm512_alignr_epi32(hits, zero, 15));
+        hits = _mm512_add_epi32(hits, _mm512_alignr_epi32(hits, zero, 14));
+        hits = _mm512_add_epi32(hits, _mm512_alignr_epi32(hits, zero, 12));
+        hits = _mm512_add_epi32(hits, _mm512_alignr_epi32(hits, zero, 8));
+        hits = _mm512_add_epi32(hits, hitsBefore);
+
+        __m512i misses = _mm512_sub_epi32(positions, hits);
+        __m512 values = _mm512_add_ps(_mm512_mul_ps(pos, _mm512_cvtepi32_ps(hits)),
+                                      _mm512_mul_ps(neg, _mm512_cvtepi32_ps(misses)));
+        maxValues = _mm512_max_ps(maxValues, values);
+
+        hitsBefore = _mm512_permutexvar_epi32(lastLane, hits);
+        positions = _mm512_add_epi32(positions, step);
+    }
+    return _mm512_reduce_max_ps(maxValues);
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+typedef float (*RunningSumMaxFunction)(const uint8_t *, uint32_t, float, float);
+
+/**
+ * @brief Chooses the fastest implementation supported by the CPU
+ * @return Running sum maximum implementation
+ */
+static RunningSumMaxFunction selectRunningSumMax()
+{
+#ifdef ESKERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return runningSumMaxAvx512;
+    if (__builtin_cpu_supports("avx2"))
+        return runningSumMaxAvx2;
+#endif
+    return runningSumMaxScalar;
+}
+
+static const RunningSumMaxFunction runningSumMaxImplementation = selectRunningSumMax();
+
+float runningSumMax(const uint8_t *hitMask, uint32_t n, float posScore, float negScore)
+{
+    return runningSumMaxImplementation(hitMask, n, posScore, negScore);
+}
+
+bool preferRunningSumMax(uint32_t nMembers, uint32_t n)
+{
+    // Measured break-even points: the vector kernels pay off from about n / 32 members, the scalar one from n / 12
+    uint32_t ratio = runningSumMaxImplementation == runningSumMaxScalar ? 12 : 32;
+    return ulong(nMembers) * ratio >= n;
+}
@@ -0,0 +1,37 @@
+/** @file eskernel.hh
+ * @brief Dense ES kernel header file */
+
+#ifndef ESKERNEL_HH
+#define ESKERNEL_HH
+
+#include <cstdint>
+
+using namespace std;
+
+/// Zeroed bytes that have to follow the hit mask passed to runningSumMax, so the vector loops never read past it
+static const uint32_t hitMaskPadding = 64;
+
+/**
+ * @brief Computes the maximum of the GSEA running sum from a membership mask over the ranked positions. The
+ * running sum at position r is posScore * c + negScore * (r + 1 - c), where c is the number of hits at
+ * positions <= r, so it is computed as a prefix sum of the mask. It uses AVX-512 or AVX2 when the CPU
+ * supports them, with a scalar fallback.
+ * @param hitMask 1 at the positions of the gene set members, 0 elsewhere
+ * @param n number of ranked positions
+ * @param posScore running sum increment of a hit
+ * @param negScore running sum increment of a miss
+ * @pre n > 0, hitMask has n elements followed by hitMaskPadding zeros
+ * @return Maximum of the running sum over the n positions
+ */
+float runningSumMax(const uint8_t *hitMask, uint32_t n, float posScore, float negScore);
+
+/**
+ * @brief Chooses between runningSumMax and walking the sorted hits of a gene set, walking the hits costs
+ * a sort of the members while the dense kernel costs a pass over every ranked position
+ * @param nMembers number of gene set members
+ * @param n number of ranked positions
+ * @return True if runningSumMax is expected to be faster, false otherwise
+ */
+bool preferRunningSumMax(uint32_t nMembers, uint32_t n);
+
+#endif
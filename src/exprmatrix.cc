@@ -0,0 +1,252 @@
+/** @file exprmatrix.cc
+ * @brief ExprMatrix implementation file */
+
+#include "exprmatrix.hh"
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ExprMatrix::ExprMatrix(uint nSamples, uint nGenes)
+{
+    this->nSamples = nSamples;
+    this->nGenes = nGenes;
+    size_t floatsPerLine = alignment / sizeof(float);
+    stride = (nGenes + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+
+    size_t bytes = max(stride * nSamples * sizeof(float), alignment);
+    data = static_cast<float *>(aligned_alloc(alignment, bytes));
+    if (data == nullptr)
+        throw bad_alloc();
+    storage = shared_ptr<void>(data, free);
+}
+
+ExprMatrix ExprMatrix::slice(uint firstSample, uint nViewSamples) const
+{
+    ExprMatrix view = *this;
+    view.nSamples = nViewSamples;
+    view.data = data + firstSample * stride;
+    return view;
+}
+
+void SparseExprMatrix::toDense(uint j, float *sample) const
+{
+    fill(sample, sample + nGenes, 0);
+    for (ulong e = offsets[j]; e < offsets[j + 1]; ++e)
+        sample[geneIds[e]] = counts[e];
+}
+
+/// Magic identifying binary expression matrix files
+static const char exprMatrixMagic[8] = "GSEAMTX";
+
+ExprMatrixWriter::ExprMatrixWriter(const string &fileName, MatrixLayout layout, uint rowLength)
+{
+    size_t floatsPerLine = ExprMatrix::alignment / sizeof(float);
+    header = ExprMatrixHeader();
+    copy(exprMatrixMagic, exprMatrixMagic + 8, header.magic);
+    header.version = 1;
+    header.layout = layout;
+    header.dtype = 0;
+    header.stride = (rowLength + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+    header.payloadOffset = sizeof(ExprMatrixHeader);
+    if (layout == SampleMajor)
+        header.nGenes = rowLength;
+    else
+        header.nSamples = rowLength;
+    nRows = 0;
+    padding = vector<float>(header.stride - rowLength, 0);
+
+    file.open(fileName, ios::binary);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+bool ExprMatrixWriter::isOpen() const
+{
+    return file.is_open();
+}
+
+void ExprMatrixWriter::writeRow(const float *row)
+{
+    uint rowLength = header.layout == SampleMajor ? header.nGenes : header.nSamples;
+    file.write(reinterpret_cast<const char *>(row), rowLength * sizeof(float));
+    file.write(reinterpret_cast<const char *>(padding.data()), padding.size() * sizeof(float));
+    ++nRows;
+}
+
+bool ExprMatrixWriter::close(const vector<string> &geneIds, const vector<string> &sampleIds)
+{
+    if (header.layout == SampleMajor)
+        header.nSamples = nRows;
+    else
+        header.nGenes = nRows;
+    header.idsOffset = header.payloadOffset + nRows * header.stride * sizeof(float);
+
+    for (const vector<string> *ids : {&geneIds, &sampleIds})
+    {
+        for (const string &id : *ids)
+        {
+            uint32_t length = id.size();
+            file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+            file.write(id.data(), length);
+        }
+    }
+
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.close();
+    return not file.fail();
+}
+
+bool isExprMatrixFile(const string &fileName)
+{
+    ifstream file(fileName, ios::binary);
+    char magic[8] = {};
+    file.read(magic, sizeof(magic));
+    return file and equal(magic, magic + 8, exprMatrixMagic);
+}
+
+/**
+ * @brief Reads count ids stored as their uint32 length followed by their characters
+ * @param cursor first id, it is moved after the last one
+ * @param end end of the ids section
+ * @param count number of ids
+ * @param ids array where the ids are appended
+ * @return False if the ids section ends before count ids, true otherwise
+ */
+static bool readIds(const char *&cursor, const char *end, uint count, vector<string> &ids)
+{
+    ids.reserve(ids.size() + count);
+    for (uint i = 0; i < count; ++i)
+    {
+        uint32_t length;
+        if (end - cursor < ptrdiff_t(sizeof(length)))
+            return false;
+        memcpy(&length, cursor, sizeof(length));
+        cursor += sizeof(length);
+        if (end - cursor < ptrdiff_t(length))
+            return false;
+        ids.emplace_back(cursor, length);
+        cursor += length;
+    }
+    return true;
+}
+
+bool mapExprMatrix(const string &fileName, ExprMatrix &matrix, vector<string> &geneIds, vector<string> &sampleIds,
+                   MatrixLayout layout)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 or size_t(fileStat.st_size) < sizeof(ExprMatrixHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    // Private writable mapping: normalization modifies copies of the pages, never the file
+    size_t size = fileStat.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+    shared_ptr<void> storage = shared_ptr<void>(mapping, [size](void *p) { munmap(p, size); });
+
+    const char *bytes = static_cast<const char *>(mapping);
+    ExprMatrixHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    uint rows = header.layout == SampleMajor ? header.nSamples : header.nGenes;
+    uint rowLength = header.layout == SampleMajor ? header.nGenes : header.nSamples;
+    bool valid = equal(header.magic, header.magic + 8, exprMatrixMagic) and header.version == 1 and
+                 header.dtype == 0 and header.layout <= GeneMajor and header.stride >= rowLength and
+                 header.payloadOffset % ExprMatrix::alignment == 0 and
+                 header.idsOffset >= header.payloadOffset + rows * header.stride * sizeof(float) and
+                 header.idsOffset <= size;
+    if (not valid)
+        return false;
+
+    const char *ids = bytes + header.idsOffset;
+    geneIds.clear();
+    sampleIds.clear();
+    if (not readIds(ids, bytes + size, header.nGenes, geneIds) or not readIds(ids, bytes + size, header.nSamples, sampleIds))
+        return false;
+
+    float *payload = reinterpret_cast<float *>(static_cast<char *>(mapping) + header.payloadOffset);
+    if (header.layout == layout)
+    {
+        matrix.nSamples = rows;
+        matrix.nGenes = rowLength;
+        matrix.stride = header.stride;
+        matrix.data = payload;
+        matrix.storage = storage;
+    }
+    else
+    {
+        matrix = ExprMatrix(rowLength, rows);
+        matrix.transposeFrom(payload, header.stride);
+    }
+    return true;
+}
+
+bool createExprMatrix(const string &fileName, MatrixLayout layout, const vector<string> &geneIds,
+                      const vector<string> &sampleIds, ExprMatrix &matrix)
+{
+    size_t floatsPerLine = ExprMatrix::alignment / sizeof(float);
+    uint rows = layout == SampleMajor ? sampleIds.size() : geneIds.size();
+    uint rowLength = layout == SampleMajor ? geneIds.size() : sampleIds.size();
+    ExprMatrixHeader header = ExprMatrixHeader();
+    copy(exprMatrixMagic, exprMatrixMagic + 8, header.magic);
+    header.version = 1;
+    header.layout = layout;
+    header.dtype = 0;
+    header.nSamples = sampleIds.size();
+    header.nGenes = geneIds.size();
+    header.stride = (rowLength + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+    header.payloadOffset = sizeof(ExprMatrixHeader);
+    header.idsOffset = header.payloadOffset + rows * header.stride * sizeof(float);
+
+    string ids;
+    for (const vector<string> *idList : {&geneIds, &sampleIds})
+    {
+        for (const string &id : *idList)
+        {
+            uint32_t length = id.size();
+            ids.append(reinterpret_cast<const char *>(&length), sizeof(length));
+            ids += id;
+        }
+    }
+
+    // The payload is a hole of the file until it is written, so it reads as zeros
+    int fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return false;
+    bool written = pwrite(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) and
+                   ftruncate(fd, header.idsOffset) == 0 and
+                   pwrite(fd, ids.data(), ids.size(), header.idsOffset) == ssize_t(ids.size());
+    void *mapping = MAP_FAILED;
+    size_t size = header.idsOffset;
+    if (written)
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    matrix.nSamples = rows;
+    matrix.nGenes = rowLength;
+    matrix.stride = header.stride;
+    matrix.data = reinterpret_cast<float *>(static_cast<char *>(mapping) + header.payloadOffset);
+    matrix.storage = shared_ptr<void>(mapping, [size](void *p) { munmap(p, size); });
+    return true;
+}
+
+bool isMatrixMarketFile(const string &fileName)
+{
+    const string banner = "%%MatrixMarket";
+    ifstream file(fileName, ios::binary);
+    string start = string(banner.size(), '\0');
+    file.read(&start[0], banner.size());
+    return file and start == banner;
+}
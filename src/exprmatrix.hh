@@ -0,0 +1,324 @@
+/** @file exprmatrix.hh
+ * @brief ExprMatrix header file
+ *
+ * Binary expression matrix format (all integers little-endian, as written by the host):
+ *
+ * | Offset    | Size          | Content                                                          |
+ * |-----------|---------------|------------------------------------------------------------------|
+ * | 0         | 64            | ExprMatrixHeader                                                 |
+ * | 64        | rows x stride | float32 payload, one row per sample or per gene (see the layout) |
+ * | idsOffset | -             | nGenes gene ids and then nSamples sample ids, each one stored as |
+ * |           |               | its uint32 length followed by its characters                     |
+ *
+ * Rows are padded to stride floats so that, since the payload starts at a 64 byte offset of a page
+ * aligned mapping, every row of a sample-major file can be used in place by ExprMatrix. */
+
+#ifndef EXPRMATRIX_HH
+#define EXPRMATRIX_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** @enum MatrixLayout
+ * @brief Order of the rows of a stored expression matrix */
+enum MatrixLayout : uint32_t
+{
+    /// Each row contains the counts of a sample (scRNA csv files and ExprMatrix)
+    SampleMajor = 0,
+    /// Each row contains the counts of a gene (bulk csv files)
+    GeneMajor = 1
+};
+
+/** @struct ExprMatrixHeader
+ * @brief Header of a binary expression matrix file */
+struct ExprMatrixHeader
+{
+    /// "GSEAMTX" followed by a null character
+    char magic[8];
+    /// Format version, currently 1
+    uint32_t version;
+    /// MatrixLayout of the payload
+    uint32_t layout;
+    /// Type of the counts, 0 for float32 (the only one supported)
+    uint32_t dtype;
+    /// Number of samples
+    uint32_t nSamples;
+    /// Number of genes
+    uint32_t nGenes;
+    uint32_t reserved;
+    /// Distance in floats between two consecutive rows of the payload
+    uint64_t stride;
+    /// Offset in bytes of the payload
+    uint64_t payloadOffset;
+    /// Offset in bytes of the gene and sample ids
+    uint64_t idsOffset;
+    uint64_t reservedEnd;
+};
+
+static_assert(sizeof(ExprMatrixHeader) == 64, "ExprMatrixHeader must keep the payload 64 byte aligned");
+
+/** @struct MatrixView
+ * @brief Non-owning view of a matrix of counts of type T with any strides, so matrices owned by someone else
+ * (as the column-major double matrices of R) are scored without being copied */
+template <typename T>
+struct MatrixView
+{
+    /// Number of samples
+    uint nSamples = 0;
+    /// Number of genes
+    uint nGenes = 0;
+    /// Count of the first gene of the first sample
+    const T *data = nullptr;
+    /// Distance between the counts of two consecutive samples
+    size_t sampleStride = 0;
+    /// Distance between the counts of two consecutive genes of a sample
+    size_t geneStride = 1;
+
+    /**
+    * @brief Copies consecutive samples as floats, reading the view in the order of its smallest stride
+    * @param firstSample first sample copied
+    * @param nCopied number of samples copied
+    * @param samples array of nCopied x nGenes counts
+    * @pre firstSample + nCopied <= nSamples
+    * @post samples[s * nGenes + i] is the count of gene i of sample firstSample + s
+    */
+    void copySamples(uint firstSample, uint nCopied, float *samples) const;
+};
+
+/** @struct ExprMatrix
+ * @brief Expression matrix stored in a single aligned buffer in sample-major layout: the counts of
+ * each sample are contiguous, so ranking, normalization and the ES kernels read them with unit stride.
+ * Copies share the same buffer. */
+struct ExprMatrix
+{
+    /// Alignment in bytes of the buffer and of every sample
+    static constexpr size_t alignment = 64;
+
+    /// Number of samples (rows)
+    uint nSamples = 0;
+    /// Number of genes (columns)
+    uint nGenes = 0;
+    /// Distance in floats between two consecutive samples, nGenes padded to the alignment
+    size_t stride = 0;
+    /// Count of the first gene of the first sample
+    float *data = nullptr;
+    /// Owner of the buffer pointed by data
+    shared_ptr<void> storage;
+
+    ExprMatrix() = default;
+
+    /**
+    * @brief Allocates an uninitialised nSamples x nGenes matrix
+    * @param nSamples number of samples
+    * @param nGenes number of genes
+    */
+    ExprMatrix(uint nSamples, uint nGenes);
+
+    /**
+    * @brief Counts of a sample
+    * @param j sample
+    * @return Pointer to the nGenes contiguous counts of sample j
+    */
+    float *sample(uint j) { return data + j * stride; }
+    const float *sample(uint j) const { return data + j * stride; }
+
+    /**
+    * @brief Fills the genes [firstGene, endGene) of the matrix from a gene-major buffer with a cache-blocked transpose
+    * @param geneMajor buffer with the counts of gene firstGene + i and sample j at geneMajor[i * geneStride + j]
+    * @param geneStride distance between two consecutive genes in geneMajor
+    * @param firstGene first gene to fill
+    * @param endGene end of the genes to fill, nGenes if it is 0
+    * @pre geneMajor contains at least (endGene - firstGene) x nSamples counts
+    * @post sample(j)[firstGene + i] == geneMajor[i * geneStride + j]
+    */
+    template <typename T>
+    void transposeFrom(const T *geneMajor, size_t geneStride, uint firstGene = 0, uint endGene = 0);
+
+    /**
+    * @brief View of consecutive samples of the matrix, sharing its buffer
+    * @param firstSample first sample of the view
+    * @param nViewSamples number of samples of the view
+    * @pre firstSample + nViewSamples <= nSamples
+    * @return Matrix whose sample j is sample(firstSample + j)
+    */
+    ExprMatrix slice(uint firstSample, uint nViewSamples) const;
+
+    /**
+    * @brief View of the matrix, valid while the matrix buffer exists
+    * @return View of all the samples of the matrix
+    */
+    MatrixView<float> view() const { return {nSamples, nGenes, data, stride, 1}; }
+};
+
+/** @class ExprMatrixWriter
+ * @brief Writes a binary expression matrix file row by row, so matrices can be converted without holding them in memory */
+class ExprMatrixWriter
+{
+private:
+    ofstream file;
+    ExprMatrixHeader header;
+    /// Number of rows written
+    uint nRows;
+    /// Zeros written after every row up to the stride
+    vector<float> padding;
+
+public:
+    /**
+    * @brief Creates the file fileName and writes a provisional header
+    * @param fileName binary file name
+    * @param layout layout of the rows that will be written
+    * @param rowLength number of counts of each row
+    */
+    ExprMatrixWriter(const string &fileName, MatrixLayout layout, uint rowLength);
+
+    /**
+    * @brief Checks if the file was created
+    * @return True if the file could be created, false otherwise
+    */
+    bool isOpen() const;
+
+    /**
+    * @brief Appends a row to the payload
+    * @param row rowLength counts
+    */
+    void writeRow(const float *row);
+
+    /**
+    * @brief Writes the ids and the final header and closes the file
+    * @param geneIds gene ids, as many as genes
+    * @param sampleIds sample ids, as many as samples
+    * @post The file is a complete binary expression matrix if every write succeeded
+    * @return True if the whole file was written, false otherwise
+    */
+    bool close(const vector<string> &geneIds, const vector<string> &sampleIds);
+};
+
+/** @struct SparseExprMatrix
+ * @brief Expression matrix storing only the non null counts of each sample (compressed sparse rows), used for
+ * scRNA matrices where most counts are null */
+struct SparseExprMatrix
+{
+    /// Number of samples (rows)
+    uint nSamples = 0;
+    /// Number of genes (columns)
+    uint nGenes = 0;
+    /// Start of every sample in geneIds and counts, with an extra final element
+    vector<ulong> offsets;
+    /// Gene of every non null count, increasing within a sample
+    vector<uint32_t> geneIds;
+    /// Non null counts
+    vector<float> counts;
+
+    /**
+    * @brief Number of non null counts of a sample
+    * @param j sample
+    * @return Number of non null counts of sample j
+    */
+    uint32_t nonNull(uint j) const { return offsets[j + 1] - offsets[j]; }
+
+    /**
+    * @brief Expands the counts of a sample
+    * @param j sample
+    * @param sample array of nGenes counts
+    * @post sample contains the counts of sample j, null counts included
+    */
+    void toDense(uint j, float *sample) const;
+};
+
+/**
+ * @brief Checks if a file is a binary expression matrix
+ * @param fileName file name
+ * @return True if the file starts with the binary expression matrix magic, false otherwise
+ */
+bool isExprMatrixFile(const string &fileName);
+
+/**
+ * @brief Loads a binary expression matrix file. Payloads stored in the requested layout are used in place
+ * from a private memory mapping, so the pages are shared through the page cache until they are modified.
+ * Payloads stored in the other layout are transposed into a new buffer.
+ * @param fileName binary file name
+ * @param matrix loaded matrix, with GeneMajor its rows are the genes: matrix.nSamples is the number of
+ * genes and matrix.sample(i) contains the counts of gene i
+ * @param geneIds gene ids of the matrix
+ * @param sampleIds sample ids of the matrix
+ * @param layout layout of the loaded matrix
+ * @return False if the file is not a valid binary expression matrix, true otherwise
+ */
+bool mapExprMatrix(const string &fileName, ExprMatrix &matrix, vector<string> &geneIds, vector<string> &sampleIds,
+                   MatrixLayout layout = SampleMajor);
+
+/**
+ * @brief Creates a zeroed binary expression matrix file and maps its payload with a shared writable mapping, so
+ * the rows written into the matrix are stored in the file and can be paged out by the OS
+ * @param fileName binary file name
+ * @param layout layout of the payload, with GeneMajor the rows of matrix are the genes as in mapExprMatrix
+ * @param geneIds gene ids of the matrix
+ * @param sampleIds sample ids of the matrix
+ * @param matrix created matrix, valid while any copy of it exists
+ * @return False if the file could not be created or mapped, true otherwise
+ */
+bool createExprMatrix(const string &fileName, MatrixLayout layout, const vector<string> &geneIds,
+                      const vector<string> &sampleIds, ExprMatrix &matrix);
+
+/**
+ * @brief Checks if a file is a Matrix Market file (the format of the 10x matrix.mtx files)
+ * @param fileName file name
+ * @return True if the file starts with the Matrix Market banner, false otherwise
+ */
+bool isMatrixMarketFile(const string &fileName);
+
+template <typename T>
+void MatrixView<T>::copySamples(uint firstSample, uint nCopied, float *samples) const
+{
+    const T *first = data + firstSample * sampleStride;
+    if (geneStride <= sampleStride)
+    {
+        for (uint s = 0; s < nCopied; ++s)
+        {
+            for (uint i = 0; i < nGenes; ++i)
+                samples[size_t(s) * nGenes + i] = float(first[s * sampleStride + i * geneStride]);
+        }
+    }
+    else
+    {
+        // Samples are the contiguous dimension, so the copied samples of a gene are read together
+        for (uint i = 0; i < nGenes; ++i)
+        {
+            for (uint s = 0; s < nCopied; ++s)
+                samples[size_t(s) * nGenes + i] = float(first[s * sampleStride + i * geneStride]);
+        }
+    }
+}
+
+template <typename T>
+void ExprMatrix::transposeFrom(const T *geneMajor, size_t geneStride, uint firstGene, uint endGene)
+{
+    if (endGene == 0)
+        endGene = nGenes;
+
+    // 64x64 tiles keep both the source rows and the destination rows in cache
+    const uint block = 64;
+    for (uint i0 = firstGene; i0 < endGene; i0 += block)
+    {
+        uint iEnd = min(i0 + block, endGene);
+        for (uint j0 = 0; j0 < nSamples; j0 += block)
+        {
+            uint jEnd = min(j0 + block, nSamples);
+            for (uint i = i0; i < iEnd; ++i)
+            {
+                const T *geneRow = geneMajor + (i - firstGene) * geneStride;
+                for (uint j = j0; j < jEnd; ++j)
+                    data[j * stride + i] = float(geneRow[j]);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,331 @@
+/** @file genesets.cc
+ * @brief GeneSets implementation file */
+
+#include "genesets.hh"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char geneSetIndexMagic[8] = {'G', 'S', 'E', 'A', 'G', 'S', 'I', '\0'};
+
+/// Initial value of the hashes (FNV-1a offset basis)
+static const uint64_t hashSeed = 0xcbf29ce484222325;
+
+/**
+ * @brief Hashes bytes 8 at a time with an FNV-1a style multiply, chaining from a previous hash
+ * @param bytes bytes to hash
+ * @param size number of bytes
+ * @param hash previous hash
+ * @return Hash of the bytes
+ */
+static uint64_t hashBytes(const char *bytes, size_t size, uint64_t hash)
+{
+    const uint64_t prime = 0x100000001b3;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; ++i)
+        hash = (hash ^ uint8_t(bytes[i])) * prime;
+    return hash;
+}
+
+/**
+ * @brief Hashes a string and its length, so consecutive strings can not be confused with their concatenation
+ * @param value string to hash
+ * @param hash previous hash
+ * @return Hash of the string
+ */
+static uint64_t hashString(string_view value, uint64_t hash)
+{
+    uint32_t length = value.size();
+    hash = hashBytes(reinterpret_cast<const char *>(&length), sizeof(length), hash);
+    return hashBytes(value.data(), value.size(), hash);
+}
+
+GeneSets::GeneSets()
+{
+    offsets.push_back(0);
+}
+
+void GeneSets::add(const string &geneSetId, const vector<string_view> &geneIds)
+{
+    geneSetIds.push_back(geneSetId);
+    ulong start = members.size();
+    for (string_view geneId : geneIds)
+    {
+        key.assign(geneId);
+        auto it = genePositions.find(key);
+        if (it == genePositions.end())
+        {
+            it = genePositions.emplace(key, genes.size()).first;
+            genes.push_back(key);
+        }
+        members.push_back(it->second);
+    }
+    sort(members.begin() + start, members.end());
+    members.erase(unique(members.begin() + start, members.end()), members.end());
+    offsets.push_back(members.size());
+}
+
+uint GeneSets::size() const
+{
+    return geneSetIds.size();
+}
+
+const string &GeneSets::id(uint k) const
+{
+    return geneSetIds[k];
+}
+
+uint32_t GeneSets::geneSetSize(uint k) const
+{
+    return offsets[k + 1] - offsets[k];
+}
+
+const uint32_t *GeneSets::geneSet(uint k) const
+{
+    return members.data() + offsets[k];
+}
+
+const string &GeneSets::gene(uint32_t g) const
+{
+    return genes[g];
+}
+
+void GeneSets::mapGenes(const vector<string> &geneIds, vector<uint32_t> &rowOffsets, vector<uint32_t> &rows) const
+{
+    // String table gene of every position, counted per gene and then placed with a prefix sum
+    const uint32_t noGene = UINT32_MAX;
+    vector<uint32_t> rowGenes = vector<uint32_t>(geneIds.size(), noGene);
+    rowOffsets = vector<uint32_t>(genes.size() + 1, 0);
+    for (uint32_t i = 0; i < geneIds.size(); ++i)
+    {
+        auto it = genePositions.find(geneIds[i]);
+        if (it != genePositions.end())
+        {
+            rowGenes[i] = it->second;
+            ++rowOffsets[it->second + 1];
+        }
+    }
+    for (uint32_t g = 0; g < genes.size(); ++g)
+        rowOffsets[g + 1] += rowOffsets[g];
+
+    rows = vector<uint32_t>(rowOffsets[genes.size()]);
+    vector<uint32_t> next = vector<uint32_t>(rowOffsets.begin(), rowOffsets.end() - 1);
+    for (uint32_t i = 0; i < geneIds.size(); ++i)
+    {
+        if (rowGenes[i] != noGene)
+            rows[next[rowGenes[i]]++] = i;
+    }
+}
+
+uint64_t GeneSets::hash() const
+{
+    uint64_t hash = hashSeed;
+    for (uint k = 0; k < size(); ++k)
+    {
+        hash = hashString(geneSetIds[k], hash);
+        uint32_t nMembers = geneSetSize(k);
+        hash = hashBytes(reinterpret_cast<const char *>(&nMembers), sizeof(nMembers), hash);
+        for (const uint32_t *g = geneSet(k); g != geneSet(k) + nMembers; ++g)
+            hash = hashString(genes[*g], hash);
+    }
+    return hash;
+}
+
+GeneSetIndex buildGeneSetIndex(const GeneSets &geneSets, const vector<string> &geneIds)
+{
+    // Every gene id of the universe is hashed once, mapping the gene sets string table to it
+    vector<uint32_t> rowOffsets, rows;
+    geneSets.mapGenes(geneIds, rowOffsets, rows);
+
+    GeneSetIndex index;
+    index.nInputGeneSets = geneSets.size();
+    vector<uint32_t> offsets = vector<uint32_t>(1, 0);
+    vector<uint32_t> sizes;
+    vector<uint32_t> nFound;
+    vector<uint32_t> members;
+    for (uint k = 0; k < geneSets.size(); ++k)
+    {
+        size_t start = members.size();
+        const uint32_t *geneSet = geneSets.geneSet(k);
+        uint32_t size = geneSets.geneSetSize(k);
+        uint32_t found = 0;
+        for (uint32_t m = 0; m < size; ++m)
+        {
+            uint32_t g = geneSet[m];
+            members.insert(members.end(), rows.begin() + rowOffsets[g], rows.begin() + rowOffsets[g + 1]);
+            found += rowOffsets[g] < rowOffsets[g + 1];
+        }
+        if (members.size() == start)
+            continue;
+
+        sort(members.begin() + start, members.end());
+        offsets.push_back(members.size());
+        sizes.push_back(size);
+        nFound.push_back(found);
+        index.ids.push_back(geneSets.id(k));
+    }
+    index.nGeneSets = index.ids.size();
+
+    // The arrays are stored one after the other, as in the cache files
+    shared_ptr<vector<uint32_t>> arrays = make_shared<vector<uint32_t>>(offsets);
+    arrays->insert(arrays->end(), sizes.begin(), sizes.end());
+    arrays->insert(arrays->end(), nFound.begin(), nFound.end());
+    arrays->insert(arrays->end(), members.begin(), members.end());
+    index.offsets = arrays->data();
+    index.sizes = index.offsets + offsets.size();
+    index.nFound = index.sizes + sizes.size();
+    index.members = index.nFound + nFound.size();
+    index.storage = arrays;
+    return index;
+}
+
+uint64_t hashFile(const string &fileName, char sep)
+{
+    ifstream file(fileName, ios::binary);
+    if (not file.is_open())
+        return 0;
+
+    // Blocks are a multiple of 8 bytes, so hashing them in sequence equals hashing the whole file
+    uint64_t hash = hashSeed;
+    vector<char> block = vector<char>(1 << 20);
+    while (file)
+    {
+        file.read(block.data(), block.size());
+        hash = hashBytes(block.data(), file.gcount(), hash);
+    }
+    return hashBytes(&sep, sizeof(sep), hash);
+}
+
+uint64_t hashGeneIds(const vector<string> &geneIds)
+{
+    uint64_t hash = hashSeed;
+    for (const string &geneId : geneIds)
+        hash = hashString(geneId, hash);
+    return hash;
+}
+
+bool writeGeneSetIndex(const string &fileName, const GeneSetIndex &index, uint64_t collectionHash, uint64_t universeHash,
+                       uint nGenes)
+{
+    // Written to a temporary file and renamed, so concurrent runs never map a partial cache
+    string tmpFileName = fileName + ".tmp" + to_string(getpid());
+    ofstream file(tmpFileName, ios::binary);
+    if (not file.is_open())
+        return false;
+
+    GeneSetIndexHeader header = {};
+    copy(geneSetIndexMagic, geneSetIndexMagic + 8, header.magic);
+    header.version = 2;
+    header.nGeneSets = index.nGeneSets;
+    header.nMembers = index.offsets[index.nGeneSets];
+    header.nInputGeneSets = index.nInputGeneSets;
+    header.nGenes = nGenes;
+    header.collectionHash = collectionHash;
+    header.universeHash = universeHash;
+    ulong nValues = 3 * ulong(index.nGeneSets) + 1 + header.nMembers;
+    header.idsOffset = sizeof(header) + nValues * sizeof(uint32_t);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(index.offsets), (index.nGeneSets + 1) * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char *>(index.sizes), index.nGeneSets * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char *>(index.nFound), index.nGeneSets * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char *>(index.members), header.nMembers * sizeof(uint32_t));
+    for (const string &id : index.ids)
+    {
+        uint32_t length = id.size();
+        file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+        file.write(id.data(), length);
+    }
+    file.close();
+    if (not file or rename(tmpFileName.c_str(), fileName.c_str()) != 0)
+    {
+        remove(tmpFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool mapGeneSetIndex(const string &fileName, uint64_t collectionHash, uint64_t universeHash, uint nGenes,
+                     GeneSetIndex &index)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 or size_t(fileStat.st_size) < sizeof(GeneSetIndexHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = fileStat.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+    shared_ptr<void> storage = shared_ptr<void>(mapping, [size](void *p) { munmap(p, size); });
+
+    const char *bytes = static_cast<const char *>(mapping);
+    GeneSetIndexHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    ulong nValues = 3 * ulong(header.nGeneSets) + 1 + header.nMembers;
+    bool valid = equal(header.magic, header.magic + 8, geneSetIndexMagic) and header.version == 2 and
+                 header.collectionHash == collectionHash and header.universeHash == universeHash and
+                 header.nGenes == nGenes and header.nMembers <= size / sizeof(uint32_t) and
+                 header.idsOffset == sizeof(header) + nValues * sizeof(uint32_t) and header.idsOffset <= size;
+    if (not valid)
+        return false;
+
+    // The kernels index the ranks with the members, so a corrupt payload must not be used
+    const uint32_t *offsets = reinterpret_cast<const uint32_t *>(bytes + sizeof(header));
+    if (offsets[0] != 0 or offsets[header.nGeneSets] != header.nMembers)
+        return false;
+    for (uint k = 0; k < header.nGeneSets; ++k)
+    {
+        if (offsets[k + 1] < offsets[k])
+            return false;
+    }
+    const uint32_t *members = offsets + 3 * ulong(header.nGeneSets) + 1;
+    for (ulong m = 0; m < header.nMembers; ++m)
+    {
+        if (members[m] >= nGenes)
+            return false;
+    }
+
+    vector<string> ids;
+    ids.reserve(header.nGeneSets);
+    const char *cursor = bytes + header.idsOffset;
+    const char *end = bytes + size;
+    for (uint k = 0; k < header.nGeneSets; ++k)
+    {
+        uint32_t length;
+        if (end - cursor < ptrdiff_t(sizeof(length)))
+            return false;
+        memcpy(&length, cursor, sizeof(length));
+        cursor += sizeof(length);
+        if (end - cursor < ptrdiff_t(length))
+            return false;
+        ids.emplace_back(cursor, length);
+        cursor += length;
+    }
+
+    index.nGeneSets = header.nGeneSets;
+    index.nInputGeneSets = header.nInputGeneSets;
+    index.offsets = offsets;
+    index.sizes = offsets + header.nGeneSets + 1;
+    index.nFound = index.sizes + header.nGeneSets;
+    index.members = members;
+    index.ids = move(ids);
+    index.storage = storage;
+    return true;
+}
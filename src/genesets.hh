@@ -0,0 +1,225 @@
+/** @file genesets.hh
+ * @brief GeneSets header file
+ *
+ * Binary gene set index cache format (all integers little-endian, as written by the host):
+ *
+ * | Offset    | Size                   | Content                                                         |
+ * |-----------|------------------------|-----------------------------------------------------------------|
+ * | 0         | 64                     | GeneSetIndexHeader                                              |
+ * | 64        | 4 x (nGeneSets + 1)    | uint32 offsets of every gene set in the members                 |
+ * | -         | 4 x nGeneSets          | uint32 size of every gene set in the gene sets collection       |
+ * | -         | 4 x nGeneSets          | uint32 distinct genes of every gene set in the gene universe    |
+ * | -         | 4 x nMembers           | uint32 members, rows of the gene universe                       |
+ * | idsOffset | -                      | nGeneSets gene set ids, each one stored as its uint32 length    |
+ * |           |                        | followed by its characters                                      |
+ *
+ * The offsets, sizes and members are used in place from a read-only memory mapping. */
+
+#ifndef GENESETS_HH
+#define GENESETS_HH
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+/** @class GeneSets
+ * @brief Gene set collection stored compactly: every distinct gene id is stored once in a string table and
+ * the members of each gene set are a sorted span of table positions in a single arena, so the memory
+ * scales with the total number of members instead of with one hash set per gene set */
+class GeneSets
+{
+private:
+    /// Id of every gene set
+    vector<string> geneSetIds;
+    /// String table with every distinct gene id of the collection
+    vector<string> genes;
+    /// Position of every gene id in genes
+    unordered_map<string, uint32_t> genePositions;
+    /// Sorted and distinct positions in genes of the members of every gene set, the ones of gene set k
+    /// are in [offsets[k], offsets[k + 1])
+    vector<uint32_t> members;
+    /// Start of every gene set in members, with an extra final element
+    vector<ulong> offsets;
+    /// Buffer used to look up gene ids in genePositions
+    string key;
+
+public:
+    /**
+    * @brief Creates an empty collection
+    */
+    GeneSets();
+
+    /**
+    * @brief Appends a gene set, repeated gene ids are stored once
+    * @param geneSetId id of the gene set
+    * @param geneIds ids of its genes, they are copied into the string table
+    * @post The gene set is the last one of the collection
+    */
+    void add(const string &geneSetId, const vector<string_view> &geneIds);
+
+    /**
+    * @brief Number of gene sets
+    * @return Number of gene sets of the collection
+    */
+    uint size() const;
+
+    /**
+    * @brief Gene set id
+    * @param k gene set
+    * @return Id of gene set k
+    */
+    const string &id(uint k) const;
+
+    /**
+    * @brief Number of distinct genes of a gene set
+    * @param k gene set
+    * @return Number of members of gene set k
+    */
+    uint32_t geneSetSize(uint k) const;
+
+    /**
+    * @brief Members of a gene set as positions in the string table, sorted
+    * @param k gene set
+    * @return First member of gene set k, it has geneSetSize(k) members
+    */
+    const uint32_t *geneSet(uint k) const;
+
+    /**
+    * @brief Gene id of the string table
+    * @param g position in the string table
+    * @return Gene id at position g
+    */
+    const string &gene(uint32_t g) const;
+
+    /**
+    * @brief Maps the string table to a gene universe, hashing every universe gene id once. A gene id may be
+    * repeated in the universe (10x features share symbols), every position of it is mapped.
+    * @param geneIds gene ids of the universe
+    * @param rowOffsets start of every string table gene in rows, with an extra final element
+    * @param rows positions in geneIds of every string table gene, the ones of gene g are in
+    * [rowOffsets[g], rowOffsets[g + 1]) in increasing order, none if g is not in geneIds
+    */
+    void mapGenes(const vector<string> &geneIds, vector<uint32_t> &rowOffsets, vector<uint32_t> &rows) const;
+
+    /**
+    * @brief Hashes the gene set ids and the gene ids of their members, in order
+    * @return 64 bit hash of the collection
+    */
+    uint64_t hash() const;
+};
+
+/** @struct GeneSetIndex
+ * @brief Gene sets reconciled with a gene universe: their members are interned as positions in the universe
+ * and stored contiguously, a gene repeated in the universe is a member once per position. The number of members
+ * of a gene set is its effective size, the one used by the ES kernels. The arrays are either built in memory or
+ * mapped from a cache file, copies share them. */
+struct GeneSetIndex
+{
+    /// Number of gene sets with members in the gene universe
+    uint nGeneSets = 0;
+    /// Number of gene sets of the collection before dropping the ones without members in the gene universe
+    uint nInputGeneSets = 0;
+    /// Start of every gene set in members, with an extra final element
+    const uint32_t *offsets = nullptr;
+    /// Size of every gene set in the collection, including the genes missing in the gene universe
+    const uint32_t *sizes = nullptr;
+    /// Number of distinct genes of every gene set in the gene universe
+    const uint32_t *nFound = nullptr;
+    /// Sorted members of every gene set, the ones of gene set k are in [offsets[k], offsets[k + 1])
+    const uint32_t *members = nullptr;
+    /// Gene set ids
+    vector<string> ids;
+    /// Owner of the arrays
+    shared_ptr<void> storage;
+
+    /**
+    * @brief Effective size of a gene set
+    * @param k gene set
+    * @return Number of positions of the gene universe that are genes of gene set k
+    */
+    uint32_t nMembers(uint k) const { return offsets[k + 1] - offsets[k]; }
+};
+
+/** @struct GeneSetIndexHeader
+ * @brief Header of a gene set index cache file */
+struct GeneSetIndexHeader
+{
+    /// "GSEAGSI" followed by a null character
+    char magic[8];
+    /// Format version, currently 2
+    uint32_t version;
+    /// Number of gene sets
+    uint32_t nGeneSets;
+    /// Number of members
+    uint64_t nMembers;
+    /// Number of gene sets of the collection
+    uint32_t nInputGeneSets;
+    /// Number of genes of the gene universe
+    uint32_t nGenes;
+    /// Hash of the gene sets collection the index was built from
+    uint64_t collectionHash;
+    /// Hash of the gene universe the index was built for
+    uint64_t universeHash;
+    /// Offset in bytes of the gene set ids
+    uint64_t idsOffset;
+    uint64_t reserved;
+};
+
+static_assert(sizeof(GeneSetIndexHeader) == 64, "GeneSetIndexHeader must have 64 bytes");
+
+/**
+ * @brief Intersects every gene set with a gene universe in one pass, hashing each universe gene id once.
+ * Gene sets without any member in the universe are dropped.
+ * @param geneSets gene sets collection
+ * @param geneIds gene ids of the universe
+ * @return Index of the gene sets with members in geneIds
+ */
+GeneSetIndex buildGeneSetIndex(const GeneSets &geneSets, const vector<string> &geneIds);
+
+/**
+ * @brief Hashes the content of a gene sets file and the separator it is parsed with, since the same bytes read
+ * with another separator are another collection
+ * @param fileName file name
+ * @param sep field separator of the file
+ * @return 64 bit hash of the file bytes and the separator, 0 if the file can not be read
+ */
+uint64_t hashFile(const string &fileName, char sep);
+
+/**
+ * @brief Hashes a gene universe
+ * @param geneIds gene ids of the universe, in order
+ * @return 64 bit hash of the gene ids
+ */
+uint64_t hashGeneIds(const vector<string> &geneIds);
+
+/**
+ * @brief Writes a gene set index cache file
+ * @param fileName cache file name
+ * @param index gene set index
+ * @param collectionHash hash of the gene sets collection the index was built from
+ * @param universeHash hash of the gene universe the index was built for
+ * @param nGenes number of genes of the gene universe
+ * @return False if the file could not be written, true otherwise
+ */
+bool writeGeneSetIndex(const string &fileName, const GeneSetIndex &index, uint64_t collectionHash, uint64_t universeHash,
+                       uint nGenes);
+
+/**
+ * @brief Maps a gene set index cache file, its arrays are used in place from a read-only memory mapping
+ * @param fileName cache file name
+ * @param collectionHash hash of the current gene sets collection
+ * @param universeHash hash of the current gene universe
+ * @param nGenes number of genes of the current gene universe
+ * @param index mapped gene set index
+ * @return False if the file does not exist, it is not valid or it was built from another collection or gene
+ * universe, true otherwise
+ */
+bool mapGeneSetIndex(const string &fileName, uint64_t collectionHash, uint64_t universeHash, uint nGenes,
+                     GeneSetIndex &index);
+
+#endif
@@ -23,11 +23,26 @@ Gsea::Gsea()
     system_clock::time_point startIOTime = system_clock::now();
 
     readConfig();
+    startPool();
+
+    {
+        PhaseTimer parseTimer(instrumentation, ParsePhase);
+        if (!scRna)
+            readRna();
+        else
+            readScRna();
+        // scRNA csv files are parsed batch by batch by runScRna
+        if (not scRna or binaryExprMatrix or sparseExprMatrix)
+            instrumentation.addBytes(ParsePhase, filesystem::file_size(expressionMatrixFilename));
+    }
+
+    prepareGeneSets([this] { return readGeneSets(); }, geneSetsCache.empty() ? 0 : hashFile(geneSetsFilename, geneSetsSep));
 
     if (!scRna)
-        readRna();
-    else
-        readScRna();
+        allocateResults();
+    geneSetStats = vector<GeneSetStats>(nGeneSets);
+    currentSample = 0;
+    chunk = 0;
 
     system_clock::time_point endIOTime = system_clock::now();
     cout << "IO elapsed time: " << duration_cast<milliseconds>(endIOTime - startIOTime).count() / 1000.0 << " s" << endl;
@@ -35,65 +50,111 @@ Gsea::Gsea()
 
 Gsea::Gsea(vector<string> &sampleIds,
            vector<string> &geneIds,
-           vector<GeneSet> &geneSets,
-           uint nThreads)
+           GeneSets geneSets,
+           uint nThreads,
+           string geneSetsCache)
 {
     currentSample = 0;
     chunk = 0;
+    ioutput = 10;
+    outputPrecision = 6;
+    memoryBudget = 0;
+    binaryExprMatrix = false;
+    sparseExprMatrix = false;
 
     if (nThreads == 0)
         this->nThreads = thread::hardware_concurrency();
     else
         this->nThreads = nThreads;
+    startPool();
     this->geneIds = geneIds;
     this->sampleIds = sampleIds;
 
     nGenes = geneIds.size();
     nSamples = sampleIds.size();
-    nGeneSets = geneSets.size();
+    this->geneSetsCache = geneSetsCache;
+    prepareGeneSets([&] { return move(geneSets); }, geneSetsCache.empty() ? 0 : geneSets.hash());
 
-    for (uint k = 0; k < nGeneSets; ++k)
-    {
-        bool hit = false;
-        for (uint i = 0; i < nGenes and not hit; ++i)
-        {
-            if (geneSets[k].geneSet.find(geneIds[i]) != geneSets[k].geneSet.end())
-                hit = true;
-        }
-        if (hit)
-            this->geneSets.push_back(geneSets[k]);
-    }
-
-    nGeneSets = this->geneSets.size();
+    geneSetStats = vector<GeneSetStats>(nGeneSets);
+    writeScores = true;
+    nRankedGeneSets = 0;
 
     cout << "[GSEA input size]" << endl;
     cout << "Sampled genes: " << nGenes << endl;
     cout << "Samples:       " << nSamples << endl;
-    cout << "Gene sets:     " << geneSets.size() << endl;
+    cout << "Gene sets:     " << nGeneSets << endl;
     cout << endl;
 }
 
-Gsea::Gsea(vector<GeneSet> &geneSets,
-           vector<vector<GeneSample>> &expressionMatrix,
+Gsea::Gsea(GeneSets geneSets,
+           const ExprMatrix &expressionMatrix,
            vector<string> &geneIds,
            vector<string> &sampleIds,
            uint threads,
-           bool scRna)
+           bool scRna,
+           string geneSetsCache)
 {
-    this->geneSets = geneSets;
     this->expressionMatrix = expressionMatrix;
     nGenes = geneIds.size();
     nSamples = sampleIds.size();
-    nGeneSets = geneSets.size();
     this->sampleIds = sampleIds;
     this->geneIds = geneIds;
-    if (nThreads == 0)
+    this->geneSetsCache = geneSetsCache;
+    prepareGeneSets([&] { return move(geneSets); }, geneSetsCache.empty() ? 0 : geneSets.hash());
+    if (threads == 0)
         this->nThreads = thread::hardware_concurrency();
     else
         this->nThreads = threads;
+    startPool();
     this->scRna = scRna;
+    // The whole matrix is in memory, runScRna uses it as if it was mapped from a binary file
+    this->binaryExprMatrix = true;
+    this->sparseExprMatrix = false;
     this->outputSep = ',';
-    results = vector<vector<float>>(geneSets.size(), vector<float>(nSamples));
+    this->outputPrecision = 6;
+    this->ioutput = 10;
+    this->batchSize = 50;
+    this->memoryBudget = 0;
+    results = vector<vector<float>>(nGeneSets, vector<float>(nSamples));
+    geneSetStats = vector<GeneSetStats>(nGeneSets);
+    writeScores = true;
+    nRankedGeneSets = 0;
+    currentSample = 0;
+    chunk = 0;
+}
+
+Gsea::Gsea(GeneSets geneSets,
+           const MatrixView<double> &expressionMatrix,
+           vector<string> &geneIds,
+           vector<string> &sampleIds,
+           uint threads,
+           string geneSetsCache)
+    : Gsea(move(geneSets), ExprMatrix(), geneIds, sampleIds, threads, false, geneSetsCache)
+{
+    doubleMatrix = expressionMatrix;
+}
+
+void Gsea::startPool()
+{
+    if (nThreads == 0)
+        nThreads = 1;
+    pool = make_unique<ThreadPool>(nThreads);
+    scratches = vector<KernelScratch>(nThreads);
+}
+
+void Gsea::allocateResults()
+{
+    if (resultsFilename.empty())
+    {
+        results = vector<vector<float>>(nGeneSets, vector<float>(nSamples));
+        return;
+    }
+
+    if (not createExprMatrix(resultsFilename, resultsLayout, geneSetIndex.ids, sampleIds, mappedResults))
+    {
+        cerr << "[ERROR] " << resultsFilename << " could not be created" << endl;
+        exit(EXIT_FAILURE);
+    }
 }
 
 void Gsea::readConfig()
@@ -115,6 +176,14 @@ void Gsea::readConfig()
         outFile << "ioutput:                    100" << endl;
         outFile << "scrna:                      0" << endl;
         outFile << "batch-size:                 50" << endl;
+        outFile << "write-scores:               1" << endl;
+        outFile << "variance-ranking:           0" << endl;
+        outFile << "gene-sets-cache:            none" << endl;
+        outFile << "output-precision:           6" << endl;
+        outFile << "results-file:               none" << endl;
+        outFile << "results-layout:             gene-sets" << endl;
+        outFile << "report-file:                none" << endl;
+        outFile << "memory-budget:              none" << endl;
 
         expressionMatrixFilename = "expression-matrix.csv";
         expressionMatrixSep = ',';
@@ -127,6 +196,14 @@ void Gsea::readConfig()
         ioutput = 0;
         scRna = 0;
         batchSize = 50;
+        writeScores = true;
+        nRankedGeneSets = 0;
+        geneSetsCache = "";
+        outputPrecision = 6;
+        resultsFilename = "";
+        resultsLayout = GeneMajor;
+        reportFilename = "";
+        memoryBudget = 0;
         outFile.close();
     }
     else
@@ -138,13 +215,49 @@ void Gsea::readConfig()
             expressionMatrixSep = '\t';
         file >> aux >> geneSetsFilename;
         file >> aux >> geneSetsSep;
+        if (geneSetsSep == 't')
+            geneSetsSep = '\t';
         file >> aux >> outputFilename;
         file >> aux >> outputSep;
+        if (outputSep == 't')
+            outputSep = '\t';
         file >> aux >> nThreads;
         file >> aux >> normalizedData;
         file >> aux >> ioutput;
         file >> aux >> scRna;
         file >> aux >> batchSize;
+
+        // Keys added later are optional, so older config files keep working
+        writeScores = true;
+        nRankedGeneSets = 0;
+        bool writeScoresValue;
+        if (file >> aux >> writeScoresValue)
+            writeScores = writeScoresValue;
+        uint nRankedGeneSetsValue;
+        if (file >> aux >> nRankedGeneSetsValue)
+            nRankedGeneSets = nRankedGeneSetsValue;
+        geneSetsCache = "";
+        if (file >> aux >> geneSetsCache and geneSetsCache == "none")
+            geneSetsCache = "";
+        outputPrecision = 6;
+        uint outputPrecisionValue;
+        if (file >> aux >> outputPrecisionValue)
+            outputPrecision = outputPrecisionValue;
+        resultsFilename = "";
+        if (file >> aux >> resultsFilename and resultsFilename == "none")
+            resultsFilename = "";
+        resultsLayout = GeneMajor;
+        string resultsLayoutName;
+        if (file >> aux >> resultsLayoutName and resultsLayoutName == "samples")
+            resultsLayout = SampleMajor;
+        reportFilename = "";
+        if (file >> aux >> reportFilename and reportFilename == "none")
+            reportFilename = "";
+        // In MB, none (or 0) to use batch-size
+        memoryBudget = 0;
+        uint memoryBudgetValue;
+        if (file >> aux >> memoryBudgetValue)
+            memoryBudget = ulong(memoryBudgetValue) << 20;
     }
 
     if (nThreads == 0)
@@ -162,6 +275,14 @@ void Gsea::readConfig()
     cout << "ioutput:                " << ioutput << endl;
     cout << "scrna:                  " << scRna << endl;
     cout << "batch-size:             " << batchSize << endl;
+    cout << "write-scores:           " << writeScores << endl;
+    cout << "variance-ranking:       " << nRankedGeneSets << endl;
+    cout << "gene-sets-cache:        " << (geneSetsCache.empty() ? "none" : geneSetsCache) << endl;
+    cout << "output-precision:       " << outputPrecision << endl;
+    cout << "results-file:           " << (resultsFilename.empty() ? "none" : resultsFilename) << endl;
+    cout << "results-layout:         " << (resultsLayout == GeneMajor ? "gene-sets" : "samples") << endl;
+    cout << "report-file:            " << (reportFilename.empty() ? "none" : reportFilename) << endl;
+    cout << "memory-budget:          " << (memoryBudget == 0 ? "none" : to_string(memoryBudget >> 20) + " MB") << endl;
     cout << endl;
 
     file.close();
@@ -169,252 +290,654 @@ void Gsea::readConfig()
 
 void Gsea::readRna()
 {
-    ifstream file(expressionMatrixFilename);
-    string line;
+    sparseExprMatrix = false;
+    if (isMatrixMarketFile(expressionMatrixFilename))
+    {
+        cerr << "[ERROR] Matrix Market expression matrices are only supported for scRNA experiments" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    binaryExprMatrix = isExprMatrixFile(expressionMatrixFilename);
+    if (binaryExprMatrix)
+    {
+        if (not mapExprMatrix(expressionMatrixFilename, expressionMatrix, geneIds, sampleIds))
+        {
+            cerr << "[ERROR] " << expressionMatrixFilename << " is not a valid binary expression matrix" << endl;
+            exit(EXIT_FAILURE);
+        }
+        nGenes = geneIds.size();
+        nSamples = sampleIds.size();
+        return;
+    }
+
+    CsvReader reader(expressionMatrixFilename);
+    if (not reader.isOpen())
+    {
+        cerr << "[ERROR] " << expressionMatrixFilename << " does not exist" << endl;
+        exit(EXIT_FAILURE);
+    }
+    string_view row, field;
 
     // Read first row (sample ids)
-    getline(file, line);
-    stringstream ssLine(line);
-    string colName;
-    uint i = 0;
-    while (getline(ssLine, colName, expressionMatrixSep))
+    reader.readLine(row);
+    while (CsvReader::nextField(row, field, expressionMatrixSep))
+        sampleIds.emplace_back(field);
+    nSamples = sampleIds.size();
+
+    // Byte ranges are parsed in parallel and then transposed at their gene offsets, in file order
+    uint nRanges = 4 * nThreads;
+    size_t dataStart = min(reader.position(), reader.fileSize());
+    size_t rangeSize = (reader.fileSize() - dataStart) / nRanges + 1;
+    vector<size_t> rangeStarts = vector<size_t>(nRanges + 1);
+    for (uint r = 0; r < nRanges; ++r)
+        rangeStarts[r] = reader.lineStart(dataStart + r * rangeSize);
+    rangeStarts[nRanges] = reader.fileSize();
+
+    vector<GeneRows> ranges = vector<GeneRows>(nRanges);
+    pool->parallelFor(nRanges, [&](uint r, uint)
     {
-        sampleIds.push_back(colName);
-        ++i;
+        readRnaJob(reader, rangeStarts[r], rangeStarts[r + 1], ranges[r]);
+    });
+    for (const GeneRows &range : ranges)
+    {
+        if (not range.invalidCount.empty())
+        {
+            cerr << "[ERROR] " << expressionMatrixFilename << ": " << range.invalidCount << endl;
+            exit(EXIT_FAILURE);
+        }
     }
 
-    i = 0;
-    while (getline(file, line))
+    vector<uint> firstGenes = vector<uint>(nRanges + 1, 0);
+    for (uint r = 0; r < nRanges; ++r)
     {
-        stringstream ssLine(line);
+        firstGenes[r + 1] = firstGenes[r] + ranges[r].geneIds.size();
+        for (string &geneId : ranges[r].geneIds)
+            geneIds.push_back(move(geneId));
+    }
 
+    nGenes = geneIds.size();
+    expressionMatrix = ExprMatrix(nSamples, nGenes);
+    pool->parallelFor(nRanges, [&](uint r, uint)
+    {
+        if (firstGenes[r] < firstGenes[r + 1])
+            expressionMatrix.transposeFrom(ranges[r].counts.data(), nSamples, firstGenes[r], firstGenes[r + 1]);
+        ranges[r].counts = vector<float>();
+    });
+}
+
+void Gsea::readRnaJob(const CsvReader &reader, size_t start, size_t end, GeneRows &rows) const
+{
+    string_view row, field;
+    size_t cursor = start;
+    while (reader.readLine(cursor, end, row))
+    {
         // Read first column (gene id)
-        string rowName;
-        getline(ssLine, rowName, expressionMatrixSep);
-        geneIds.push_back(rowName);
+        string_view rowName;
+        CsvReader::nextField(row, rowName, expressionMatrixSep);
 
-        string valueStr;
-        bool first = true;
         bool nullRow = true;
+        size_t rowStart = rows.counts.size();
+        rows.counts.resize(rowStart + nSamples, 0);
         uint j = 0;
-        while (getline(ssLine, valueStr, expressionMatrixSep))
+        while (j < nSamples and CsvReader::nextField(row, field, expressionMatrixSep))
         {
-            if (first)
-            {
-                expressionMatrix.push_back(vector<GeneSample>(sampleIds.size()));
-                first = false;
-            }
-            float count = stof(valueStr);
+            float count;
+            if (not CsvReader::parseFloat(field, count) and rows.invalidCount.empty())
+                rows.invalidCount = "count \"" + string(field) + "\" of gene " + string(rowName) + " in column " +
+                                    to_string(j + 2) + " is not a number";
             if (nullRow and count != 0)
                 nullRow = false;
-            expressionMatrix[i][j] = {i, count};
+            rows.counts[rowStart + j] = count;
             ++j;
         }
         if (nullRow)
+            rows.counts.resize(rowStart);
+        else
+            rows.geneIds.emplace_back(rowName);
+    }
+}
+
+void Gsea::readScRna()
+{
+    sparseExprMatrix = isMatrixMarketFile(expressionMatrixFilename);
+    if (sparseExprMatrix)
+    {
+        binaryExprMatrix = false;
+        readMatrixMarket();
+        return;
+    }
+
+    binaryExprMatrix = isExprMatrixFile(expressionMatrixFilename);
+    if (binaryExprMatrix)
+    {
+        // The whole matrix is mapped, batches are views of it
+        if (not mapExprMatrix(expressionMatrixFilename, expressionMatrix, geneIds, sampleIds))
         {
-            expressionMatrix.pop_back();
-            geneIds.pop_back();
+            cerr << "[ERROR] " << expressionMatrixFilename << " is not a valid binary expression matrix" << endl;
+            exit(EXIT_FAILURE);
         }
-        else
-            ++i;
+        nGenes = geneIds.size();
+        nSamples = sampleIds.size();
+        return;
     }
 
-    nGenes = expressionMatrix.size();
-    if (nGenes > 0)
-        nSamples = expressionMatrix[0].size();
-    file.close();
+    // Read first row of the expression matrix (gene ids)
+    CsvReader reader(expressionMatrixFilename);
+    if (not reader.isOpen())
+    {
+        cerr << "[ERROR] " << expressionMatrixFilename << " does not exist" << endl;
+        exit(EXIT_FAILURE);
+    }
+    string_view header, field;
+    reader.readLine(header);
+    while (CsvReader::nextField(header, field, expressionMatrixSep))
+        geneIds.emplace_back(field);
+    nGenes = geneIds.size();
+    nSamples = 0;
+}
 
-    file = ifstream(geneSetsFilename);
-    while (getline(file, line))
+void Gsea::readMatrixMarket()
+{
+    CsvReader reader(expressionMatrixFilename);
+    if (not reader.isOpen())
     {
-        stringstream ssLine(line);
+        cerr << "[ERROR] " << expressionMatrixFilename << " does not exist" << endl;
+        exit(EXIT_FAILURE);
+    }
 
-        string rowName;
-        getline(ssLine, rowName, geneSetsSep);
+    string_view line, word;
+    reader.readLine(line);
+    if (line.find("coordinate") == string_view::npos or line.find("general") == string_view::npos)
+    {
+        cerr << "[ERROR] " << expressionMatrixFilename << " is not a general coordinate Matrix Market file" << endl;
+        exit(EXIT_FAILURE);
+    }
+    bool pattern = line.find("pattern") != string_view::npos;
+
+    // Skip comments, the first other line contains the matrix size
+    bool sizeRead = false;
+    while (not sizeRead and reader.readLine(line))
+        sizeRead = not line.empty() and line[0] != '%';
+    uint64_t size[3] = {0, 0, 0};
+    bool sizeValid = true;
+    for (uint i = 0; i < 3 and CsvReader::nextWord(line, word); ++i)
+        sizeValid = CsvReader::parseUInt(word, size[i]) and sizeValid;
+    if (not sizeRead or not sizeValid or size[0] == 0 or size[1] == 0)
+    {
+        cerr << "[ERROR] " << expressionMatrixFilename << " has no matrix size line" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    filesystem::path folder = filesystem::path(expressionMatrixFilename).parent_path();
+    filesystem::path featuresFile = folder / "features.tsv";
+    if (not filesystem::exists(featuresFile))
+        featuresFile = folder / "genes.tsv";
+    filesystem::path barcodesFile = folder / "barcodes.tsv";
+    // The second column of 10x features files contains the gene symbols
+    readMatrixMarketIds(featuresFile, 1, geneIds);
+    readMatrixMarketIds(barcodesFile, 0, sampleIds);
+    if (geneIds.size() != size[0] or sampleIds.size() != size[1])
+    {
+        cerr << "[ERROR] " << featuresFile.string() << " and " << barcodesFile.string() << " must have "
+             << size[0] << " genes and " << size[1] << " samples" << endl;
+        exit(EXIT_FAILURE);
+    }
+    nGenes = geneIds.size();
+    nSamples = sampleIds.size();
+
+    uint nRanges = 4 * nThreads;
+    size_t dataStart = min(reader.position(), reader.fileSize());
+    size_t rangeSize = (reader.fileSize() - dataStart) / nRanges + 1;
+    vector<size_t> rangeStarts = vector<size_t>(nRanges + 1);
+    for (uint r = 0; r < nRanges; ++r)
+        rangeStarts[r] = reader.lineStart(dataStart + r * rangeSize);
+    rangeStarts[nRanges] = reader.fileSize();
+
+    vector<SparseEntries> ranges = vector<SparseEntries>(nRanges);
+    pool->parallelFor(nRanges, [&](uint r, uint)
+    {
+        readMatrixMarketJob(reader, rangeStarts[r], rangeStarts[r + 1], pattern, ranges[r]);
+    });
+
+    // Entries are bucketed by sample, in file order
+    sparseMatrix.nSamples = nSamples;
+    sparseMatrix.nGenes = nGenes;
+    sparseMatrix.offsets = vector<ulong>(nSamples + 1, 0);
+    ulong nInvalid = 0;
+    for (const SparseEntries &entries : ranges)
+    {
+        nInvalid += entries.nInvalid;
+        for (uint32_t j : entries.sampleIds)
+            ++sparseMatrix.offsets[j + 1];
+    }
+    if (nInvalid > 0)
+    {
+        cerr << "[ERROR] " << expressionMatrixFilename << " has " << nInvalid << " entries that are not numbers or are out of the matrix size" << endl;
+        exit(EXIT_FAILURE);
+    }
+    for (uint j = 0; j < nSamples; ++j)
+        sparseMatrix.offsets[j + 1] += sparseMatrix.offsets[j];
 
-        unordered_set<string> genes;
-        string valueStr;
-        while (getline(ssLine, valueStr, geneSetsSep))
+    sparseMatrix.geneIds = vector<uint32_t>(sparseMatrix.offsets[nSamples]);
+    sparseMatrix.counts = vector<float>(sparseMatrix.offsets[nSamples]);
+    vector<ulong> cursor(sparseMatrix.offsets.begin(), sparseMatrix.offsets.end() - 1);
+    for (SparseEntries &entries : ranges)
+    {
+        for (size_t e = 0; e < entries.sampleIds.size(); ++e)
         {
-            genes.insert(valueStr);
+            ulong position = cursor[entries.sampleIds[e]]++;
+            sparseMatrix.geneIds[position] = entries.geneIds[e];
+            sparseMatrix.counts[position] = entries.counts[e];
         }
-        geneSets.push_back({rowName, genes});
+        entries = SparseEntries();
     }
-    file.close();
-
-    nGeneSets = geneSets.size();
 
-    results = vector<vector<float>>(geneSets.size(), vector<float>(nSamples));
+    // 10x files list the genes of each sample in increasing order, other files are sorted here
+    pool->parallelFor(nThreads, [&](uint t, uint)
+    {
+        vector<pair<uint32_t, float>> sample;
+        for (uint j = ulong(nSamples) * t / nThreads; j < ulong(nSamples) * (t + 1) / nThreads; ++j)
+        {
+            uint32_t *genes = sparseMatrix.geneIds.data() + sparseMatrix.offsets[j];
+            float *counts = sparseMatrix.counts.data() + sparseMatrix.offsets[j];
+            uint32_t n = sparseMatrix.nonNull(j);
+            if (is_sorted(genes, genes + n))
+                continue;
+            sample.resize(n);
+            for (uint32_t e = 0; e < n; ++e)
+                sample[e] = {genes[e], counts[e]};
+            sort(sample.begin(), sample.end());
+            for (uint32_t e = 0; e < n; ++e)
+            {
+                genes[e] = sample[e].first;
+                counts[e] = sample[e].second;
+            }
+        }
+    });
 }
 
-void Gsea::readScRna()
+void Gsea::readMatrixMarketJob(const CsvReader &reader, size_t start, size_t end, bool pattern, SparseEntries &entries) const
 {
-    // Read gene sets file
-    ifstream file = ifstream(geneSetsFilename);
-    string line;
-    uint i = 0;
-    while (getline(file, line))
+    string_view line, word;
+    size_t cursor = start;
+    while (reader.readLine(cursor, end, line))
     {
-        stringstream ssLine(line);
+        if (line.empty() or line[0] == '%')
+            continue;
+
+        uint64_t gene = 0, sample = 0;
+        bool valid = CsvReader::nextWord(line, word) and CsvReader::parseUInt(word, gene);
+        valid = CsvReader::nextWord(line, word) and CsvReader::parseUInt(word, sample) and valid;
+        float count = 1;
+        if (not pattern)
+            valid = CsvReader::nextWord(line, word) and CsvReader::parseFloat(word, count) and valid;
+
+        // Indices are one-based
+        if (not valid or gene == 0 or gene > nGenes or sample == 0 or sample > nSamples)
+            ++entries.nInvalid;
+        else if (count != 0)
+        {
+            entries.geneIds.push_back(gene - 1);
+            entries.sampleIds.push_back(sample - 1);
+            entries.counts.push_back(count);
+        }
+    }
+}
 
-        string rowName;
-        getline(ssLine, rowName, geneSetsSep);
+void Gsea::readMatrixMarketIds(const filesystem::path &fileName, uint column, vector<string> &ids) const
+{
+    CsvReader reader(fileName.string());
+    if (not reader.isOpen())
+    {
+        cerr << "[ERROR] " << fileName.string() << " does not exist" << endl;
+        exit(EXIT_FAILURE);
+    }
 
-        unordered_set<string> genes;
-        string valueStr;
-        while (getline(ssLine, valueStr, geneSetsSep))
+    string_view line, field;
+    while (reader.readLine(line))
+    {
+        string_view id;
+        for (uint c = 0; c <= column and CsvReader::nextField(line, field, '\t'); ++c)
         {
-            genes.insert(valueStr);
+            if (c == 0 or c == column)
+                id = field;
         }
-        geneSets.push_back({rowName, genes});
-        ++i;
+        ids.emplace_back(id);
     }
-    nGeneSets = geneSets.size();
-    file.close();
 }
 
-void Gsea::runScRna()
+GeneSets Gsea::readGeneSets() const
 {
-    ifstream file = ifstream(expressionMatrixFilename);
-    ofstream oFile = ofstream(outputFilename);
-    string line;
+    CsvReader reader(geneSetsFilename);
+    if (not reader.isOpen())
+    {
+        cerr << "[ERROR] " << geneSetsFilename << " does not exist" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    GeneSets geneSets;
+    string_view line, field;
+    vector<string_view> genes;
+    while (reader.readLine(line))
+    {
+        CsvReader::nextField(line, field, geneSetsSep);
+        string rowName = string(field);
 
-    // Ignore first row, already read
-    getline(file, line);
+        genes.clear();
+        while (CsvReader::nextField(line, field, geneSetsSep))
+            genes.push_back(field);
+        geneSets.add(rowName, genes);
+    }
+    return geneSets;
+}
 
-    bool first = true;
-    for (auto geneSet : geneSets)
+void Gsea::readScRnaBatch(CsvReader *reader, const ExprMatrix &mappedMatrix, uint firstSample, uint maxSamples,
+                          ScRnaBatch &batch)
+{
+    uint capacity = min<ulong>(maxSamples, batch.sampleNames.size());
+    batch.firstSample = firstSample;
+    if (reader == nullptr)
     {
-        if (first)
-            first = false;
+        if (sparseExprMatrix)
+            batch.nSamples = min(capacity, sparseMatrix.nSamples - firstSample);
         else
-            oFile << ",";
-        oFile << geneSet.geneSetId;
+        {
+            batch.nSamples = min(capacity, mappedMatrix.nSamples - firstSample);
+            batch.expressionMatrix = mappedMatrix.slice(firstSample, batch.nSamples);
+        }
+        for (uint i = 0; i < batch.nSamples; ++i)
+            batch.sampleNames[i] = sampleIds[firstSample + i];
+        return;
     }
-    oFile << endl;
-
-    uint nLines = batchSize;
-    uint totalLines = nThreads * nLines;
-    expressionMatrix = vector<vector<GeneSample>>(totalLines);
-    vector<string> sampleNames = vector<string>(totalLines);
-    results = vector<vector<float>>(totalLines, vector<float>(geneSets.size()));
 
+    PhaseTimer parseTimer(instrumentation, ParsePhase);
+    size_t batchStart = reader->position();
+    string_view line, field;
     uint i = 0;
-    first = true;
-    while (getline(file, line))
+    while (i < capacity and reader->readLine(line))
     {
-        stringstream ssLine(line);
-
         // Read first column (sample id)
-        string rowName;
-        getline(ssLine, rowName, expressionMatrixSep);
-        sampleNames[i % totalLines] = rowName;
+        string_view rowName;
+        CsvReader::nextField(line, rowName, expressionMatrixSep);
+        batch.sampleNames[i] = rowName;
 
-        string valueStr;
+        float *sample = batch.expressionMatrix.sample(i);
+        fill(sample, sample + nGenes, 0);
         uint j = 0;
-        while (getline(ssLine, valueStr, expressionMatrixSep))
+        while (j < nGenes and CsvReader::nextField(line, field, expressionMatrixSep))
         {
-            if (first)
-                expressionMatrix[i % totalLines].push_back({j, stof(valueStr)});
-            else
-                expressionMatrix[i % totalLines][j] = {j, stof(valueStr)};
+            if (not CsvReader::parseFloat(field, sample[j]))
+            {
+                cerr << "[ERROR] " << expressionMatrixFilename << ": count \"" << field << "\" of sample " << rowName
+                     << " in column " << j + 2 << " is not a number" << endl;
+                exit(EXIT_FAILURE);
+            }
             ++j;
         }
+        ++i;
+    }
+    batch.nSamples = i;
+    instrumentation.addBytes(ParsePhase, reader->position() - batchStart);
+}
 
-        if (i != 0 and i % (totalLines - 1) == 0)
+void Gsea::accumulateStats(const vector<vector<float>> &batchResults, uint nBatchSamples)
+{
+    uint nRanges = min(nGeneSets, 4 * pool->size());
+    pool->parallelFor(nRanges, [&](uint r, uint)
+    {
+        uint startSet = ulong(nGeneSets) * r / nRanges;
+        uint endSet = ulong(nGeneSets) * (r + 1) / nRanges;
+        vector<GeneSetStats> batchStats = vector<GeneSetStats>(endSet - startSet);
+        for (uint j = 0; j < nBatchSamples; ++j)
         {
-            first = false;
-            vector<thread> threads = vector<thread>(nThreads);
-            for (uint t = 0; t < nThreads; ++t)
-            {
-                uint startLine = nLines * t;
-                uint endLine = startLine + nLines;
-                threads[t] = thread(&Gsea::scEnrichmentScoreJob, this, startLine, endLine);
-            }
+            const float *row = batchResults[j].data();
+            for (uint k = startSet; k < endSet; ++k)
+                batchStats[k - startSet].add(row[k]);
+        }
+        for (uint k = startSet; k < endSet; ++k)
+            geneSetStats[k].merge(batchStats[k - startSet]);
+    });
+}
 
-            for (thread &t : threads)
-                t.join();
+void Gsea::readScRnaStage(CsvReader *reader, const ExprMatrix &mappedMatrix,
+                          BoundedQueue<unique_ptr<ScRnaBatch>> &freeBatches,
+                          BoundedQueue<unique_ptr<ScRnaBatch>> &parsedBatches)
+{
+    uint samplesRead = 0;
+    unique_ptr<ScRnaBatch> batch;
+    while (freeBatches.pop(batch))
+    {
+        readScRnaBatch(reader, mappedMatrix, samplesRead, batchSizer.size(), *batch);
+        if (batch->nSamples == 0)
+            break;
+        samplesRead += batch->nSamples;
+        parsedBatches.push(move(batch));
+    }
+    parsedBatches.close();
+}
 
-            for (uint t = 0; t < totalLines; ++t)
+void Gsea::writeScRnaStage(ResultWriter *writer,
+                           BoundedQueue<unique_ptr<ScRnaBatch>> &scoredBatches,
+                           BoundedQueue<unique_ptr<ScRnaBatch>> &freeBatches)
+{
+    uint samplesWritten = 0;
+    unique_ptr<ScRnaBatch> batch;
+    while (scoredBatches.pop(batch))
+    {
+        if (writer != nullptr)
+        {
+            PhaseTimer writeTimer(instrumentation, WritePhase);
+            ulong bytesBefore = writer->bytesWritten();
+            writer->writeRows(batch->nSamples, nGeneSets, [&](uint t, RowBuffer &buffer)
             {
-                oFile << sampleNames[t];
-                for (uint l = 0; l < geneSets.size(); ++l)
-                {
-                    oFile << results[t][l] << ",";
-                }
-                oFile << endl;
-            }
+                buffer.appendId(batch->sampleNames[t]);
+                buffer.appendValues(batch->results[t].data(), nGeneSets);
+            });
+            instrumentation.addBytes(WritePhase, writer->bytesWritten() - bytesBefore);
+        }
+        samplesWritten += batch->nSamples;
+        freeBatches.push(move(batch));
 
-            system_clock::time_point now = system_clock::now();
-            printTime(now);
-            cout << " Sample " << i;
-            uint ETA = (nSamples - i) * duration_cast<milliseconds>(now - startGSEATime).count() / (i * 60 * 1000);
-            cout << " ETA: " << ETA << " min" << endl;
+        system_clock::time_point now = system_clock::now();
+        printTime(now);
+        cout << " Sample " << samplesWritten;
+        if (nSamples > 0)
+        {
+            ulong ETA = (nSamples - samplesWritten) * duration_cast<milliseconds>(now - startGSEATime).count() / (samplesWritten * 60 * 1000);
+            cout << " ETA: " << ETA << " min";
         }
-        ++i;
+        cout << endl;
     }
+}
 
-    uint offset = i % totalLines;
-    uint linesPerThread = offset / nThreads;
-    uint offsetLines = linesPerThread % nThreads;
-    vector<thread> threads = vector<thread>(nThreads);
-    for (uint t = 0; t < nThreads; ++t)
+BatchPlan Gsea::planScRnaBatches() const
+{
+    if (memoryBudget == 0)
     {
-        uint startLine = linesPerThread * t;
-        uint endLine = startLine + linesPerThread;
-        if (t == nThreads - 1)
-            endLine += offsetLines;
-        threads[t] = thread(&Gsea::scEnrichmentScoreJob, this, startLine, endLine);
+        uint totalLines = nThreads * batchSize;
+        return BatchPlan{totalLines, totalLines, pipelineDepth, true};
     }
 
-    for (thread &t : threads)
-        t.join();
+    // Results row and id of every sample, and its expression row if the batch is parsed from a csv
+    ulong sampleBytes = ulong(nGeneSets) * sizeof(float) + sizeof(vector<float>) + sizeof(string);
+    if (not binaryExprMatrix and not sparseExprMatrix)
+        sampleBytes += ulong(nGenes) * sizeof(float);
+    ulong fixedBytes = nThreads * KernelScratch::bytes(nGenes);
+    if (writeScores)
+        fixedBytes += ResultWriter::bufferBytes(formatThreads(), nGeneSets);
+
+    // A block of samples per thread at least, so every batch keeps the workers busy
+    uint minSamples = nThreads * KernelScratch::blockSamples;
+    uint maxSamples = nSamples > 0 ? (ulong(nSamples) + minSamples - 1) / minSamples * minSamples : maxBatchSamples;
+    return planBatches(memoryBudget, fixedBytes, sampleBytes, minSamples, max(minSamples, maxSamples), pipelineDepth);
+}
+
+uint Gsea::formatThreads() const
+{
+    return max(1u, nThreads / 4);
+}
 
-    for (uint t = 0; t < offset; ++t)
+void Gsea::runScRna()
+{
+    // The writer formats on a pool of its own: parallelFor calls on the scoring pool are serialized, so sharing
+    // it would make writing a batch wait for scoring the next one and the other way around
+    unique_ptr<ThreadPool> formatPool;
+    unique_ptr<ResultWriter> writer;
+    if (writeScores)
     {
-        oFile << sampleNames[t];
-        for (uint l = 0; l < geneSets.size(); ++l)
-        {
-            oFile << results[t][l] << ",";
-        }
-        oFile << endl;
+        formatPool = make_unique<ThreadPool>(formatThreads());
+        writer = make_unique<ResultWriter>(outputFilename, outputSep, outputPrecision, formatPool.get());
+        writer->writeHeader(geneSetIndex.ids);
     }
 
-    file.close();
-}
+    // Binary inputs are already mapped in expressionMatrix and sparse inputs read in sparseMatrix, csv
+    // inputs are parsed batch by batch
+    unique_ptr<CsvReader> reader;
+    if (not binaryExprMatrix and not sparseExprMatrix)
+    {
+        reader = make_unique<CsvReader>(expressionMatrixFilename);
+        // Ignore first row, already read
+        string_view line;
+        reader->readLine(line);
+    }
 
-void Gsea::rpm()
-{
-    for (uint j = 0; j < nSamples; ++j)
+    BatchPlan plan = planScRnaBatches();
+    batchSizer.reset(plan.initialSamples, plan.maxSamples);
+    if (memoryBudget > 0)
     {
-        float sum = 0;
+        if (not plan.fits)
+            cerr << "[WARNING] memory-budget of " << (memoryBudget >> 20) << " MB is below " << plan.depth
+                 << " batches of " << plan.maxSamples << " samples, they are used anyway" << endl;
+        cout << "Batches of " << plan.initialSamples << " to " << plan.maxSamples << " samples, "
+             << plan.depth << " in flight" << endl;
+    }
 
-        for (uint i = 0; i < nGenes; ++i)
-            sum += expressionMatrix[i][j].count;
+    BoundedQueue<unique_ptr<ScRnaBatch>> freeBatches(plan.depth);
+    BoundedQueue<unique_ptr<ScRnaBatch>> parsedBatches(plan.depth);
+    BoundedQueue<unique_ptr<ScRnaBatch>> scoredBatches(plan.depth);
+    for (uint b = 0; b < plan.depth; ++b)
+    {
+        unique_ptr<ScRnaBatch> batch = make_unique<ScRnaBatch>();
+        if (not binaryExprMatrix and not sparseExprMatrix)
+            batch->expressionMatrix = ExprMatrix(plan.maxSamples, nGenes);
+        batch->sampleNames = vector<string>(plan.maxSamples);
+        batch->results = vector<vector<float>>(plan.maxSamples, vector<float>(nGeneSets));
+        batch->nSamples = 0;
+        freeBatches.push(move(batch));
+    }
 
-        float multFactor = 1000000 / sum;
-        for (uint i = 0; i < nGenes; ++i)
-            expressionMatrix[i][j].count *= multFactor;
+    thread parser = thread(&Gsea::readScRnaStage, this, reader.get(), cref(expressionMatrix), ref(freeBatches), ref(parsedBatches));
+    thread writerThread = thread(&Gsea::writeScRnaStage, this, writer.get(), ref(scoredBatches), ref(freeBatches));
+
+    // Batches are scored in the order they are parsed, so the writer keeps the input order
+    unique_ptr<ScRnaBatch> batch;
+    while (parsedBatches.pop(batch))
+    {
+        // Only scoring is timed, the sizer measures the throughput of the kernels
+        steady_clock::time_point scoreStart = steady_clock::now();
+        if (sparseExprMatrix)
+            scEnrichmentScore(batch->firstSample, batch->nSamples, batch->results);
+        else
+            scEnrichmentScore(batch->expressionMatrix.slice(0, batch->nSamples).view(), batch->results);
+        batchSizer.record(batch->nSamples, duration<double>(steady_clock::now() - scoreStart).count());
+        accumulateStats(batch->results, batch->nSamples);
+        instrumentation.addScoredSamples(batch->nSamples);
+        scoredBatches.push(move(batch));
     }
+    scoredBatches.close();
+
+    parser.join();
+    writerThread.join();
+    if (memoryBudget > 0)
+        cout << "Batches settled at " << batchSizer.size() << " samples" << endl;
+    if (writer and not writer->close())
+        cerr << "[ERROR] " << outputFilename << " could not be written" << endl;
 }
 
-void Gsea::meanCenter()
+bool Gsea::writeExprMatrix(string outFileName)
 {
-    for (uint i = 0; i < nGenes; ++i)
+    ExprMatrixWriter writer(outFileName, SampleMajor, nGenes);
+    if (not writer.isOpen())
     {
-        float mean = 0;
-        for (uint j = 0; j < nSamples; ++j)
-            mean += expressionMatrix[i][j].count;
-        mean /= nSamples;
+        cerr << "[ERROR] " << outFileName << " could not be created" << endl;
+        return false;
+    }
 
+    bool written;
+    if (not scRna)
+    {
+        for (uint j = 0; j < nSamples; ++j)
+            writer.writeRow(expressionMatrix.sample(j));
+        written = writer.close(geneIds, sampleIds);
+    }
+    else if (sparseExprMatrix)
+    {
+        vector<float> sample = vector<float>(nGenes);
         for (uint j = 0; j < nSamples; ++j)
-            expressionMatrix[i][j].count -= mean;
+        {
+            sparseMatrix.toDense(j, sample.data());
+            writer.writeRow(sample.data());
+        }
+        written = writer.close(geneIds, sampleIds);
+    }
+    else
+    {
+        // scRNA matrices are streamed batch by batch, they may not fit in memory
+        vector<string> writtenSampleIds;
+        ScRnaBatch batch;
+        batch.sampleNames = vector<string>(batchSize);
+        unique_ptr<CsvReader> reader;
+        if (not binaryExprMatrix)
+        {
+            reader = make_unique<CsvReader>(expressionMatrixFilename);
+            string_view line;
+            reader->readLine(line);
+            batch.expressionMatrix = ExprMatrix(batchSize, nGenes);
+        }
+
+        readScRnaBatch(reader.get(), expressionMatrix, 0, batchSize, batch);
+        while (batch.nSamples > 0)
+        {
+            for (uint i = 0; i < batch.nSamples; ++i)
+            {
+                writer.writeRow(batch.expressionMatrix.sample(i));
+                writtenSampleIds.push_back(batch.sampleNames[i]);
+            }
+            readScRnaBatch(reader.get(), expressionMatrix, writtenSampleIds.size(), batchSize, batch);
+        }
+        written = writer.close(geneIds, writtenSampleIds);
+    }
+
+    if (not written)
+    {
+        cerr << "[ERROR] " << outFileName << " could not be written" << endl;
+        return false;
     }
+    cout << "Expression matrix written in " << outFileName << endl;
+    return true;
 }
 
-bool Gsea::geneSampleComp(const GeneSample &g1, const GeneSample &g2)
+/**
+ * @brief Sums an array with 8 independent partial sums, so the compiler can keep them in a vector register
+ * @param values n values
+ * @param n number of values
+ * @return Sum of the values
+ */
+static float vectorSum(const float *values, uint n)
 {
-    return g1.count > g2.count;
+    float partialSums[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    uint i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        for (uint l = 0; l < 8; ++l)
+            partialSums[l] += values[i + l];
+    }
+    float sum = 0;
+    for (uint l = 0; l < 8; ++l)
+        sum += partialSums[l];
+    for (; i < n; ++i)
+        sum += values[i];
+    return sum;
 }
 
 bool Gsea::geneSetPtrComp(const GeneSetPtr &g1, const GeneSetPtr &g2)
@@ -422,167 +945,415 @@ bool Gsea::geneSetPtrComp(const GeneSetPtr &g1, const GeneSetPtr &g2)
     return g1.value > g2.value;
 }
 
-void Gsea::sortColumnsJob(uint startSample, uint endSample)
+void Gsea::prepareGeneSets(const function<GeneSets()> &readCollection, uint64_t collectionHash)
 {
-    for (uint j = startSample; j < endSample; ++j)
+    uint64_t universeHash = geneSetsCache.empty() ? 0 : hashGeneIds(geneIds);
+    if (not geneSetsCache.empty() and mapGeneSetIndex(geneSetsCache, collectionHash, universeHash, nGenes, geneSetIndex))
+        cout << "Gene set index read from " << geneSetsCache << endl;
+    else
     {
-        vector<GeneSample> column = vector<GeneSample>(nGenes);
-        for (uint i = 0; i < nGenes; ++i)
-            column[i] = expressionMatrix[i][j];
-        sort(column.begin(), column.end(), &Gsea::geneSampleComp);
-        for (uint i = 0; i < nGenes; ++i)
-            expressionMatrix[i][j] = column[i];
+        geneSetIndex = buildGeneSetIndex(readCollection(), geneIds);
+        if (not geneSetsCache.empty() and
+            not writeGeneSetIndex(geneSetsCache, geneSetIndex, collectionHash, universeHash, nGenes))
+            cerr << "[WARNING] the gene set index could not be written in " << geneSetsCache << endl;
+    }
+    nGeneSets = geneSetIndex.nGeneSets;
+
+    ulong nFound = 0;
+    ulong nInputMembers = 0;
+    for (uint k = 0; k < nGeneSets; ++k)
+    {
+        nFound += geneSetIndex.nFound[k];
+        nInputMembers += geneSetIndex.sizes[k];
     }
+    cout << "Gene sets in the expression matrix: " << nGeneSets << " of " << geneSetIndex.nInputGeneSets;
+    if (nGeneSets > 0)
+        cout << ", " << 100.0 * nFound / nInputMembers << "% of their genes";
+    cout << endl;
 }
 
-void Gsea::enrichmentScore()
+uint32_t Gsea::rankSample(const float *counts, KernelScratch &scratch, uint s) const
+{
+    const uint blockSamples = KernelScratch::blockSamples;
+    scratch.blockRanks.resize(size_t(nGenes) * blockSamples);
+    scratch.sparseRanks = false;
+    vector<uint32_t> &order = scratch.blockOrders[s];
+    order.resize(nGenes);
+    rankGenes(counts, nGenes, scratch.rankScratch, order.data());
+
+    uint32_t nRanked = nGenes;
+    for (uint32_t i = 0; i < nGenes; ++i)
+    {
+        uint32_t geneId = order[i];
+        scratch.blockRanks[size_t(geneId) * blockSamples + s] = i;
+        if (counts[geneId] == 0 and nRanked == nGenes)
+            nRanked = i;
+    }
+    return nRanked;
+}
+
+uint32_t Gsea::rankSparseSample(const uint32_t *sampleGenes, const float *counts, uint32_t n, KernelScratch &scratch, uint s) const
+{
+    const uint blockSamples = KernelScratch::blockSamples;
+    size_t blockRanksSize = size_t(nGenes) * blockSamples;
+    if (not scratch.sparseRanks or scratch.blockRanks.size() != blockRanksSize)
+    {
+        scratch.blockRanks.assign(blockRanksSize, nGenes);
+        for (vector<uint32_t> &order : scratch.blockOrders)
+            order.clear();
+        scratch.sparseRanks = true;
+    }
+
+    // Only the genes ranked for the previous sparse sample of s have to be unranked
+    vector<uint32_t> &order = scratch.blockOrders[s];
+    for (uint32_t geneId : order)
+        scratch.blockRanks[size_t(geneId) * blockSamples + s] = nGenes;
+
+    // Genes are increasing, so the stable ranking keeps ties in increasing gene id order
+    order.resize(n);
+    rankGenes(counts, n, scratch.rankScratch, order.data());
+
+    uint32_t nPositive = 0;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        uint32_t entry = order[i];
+        if (counts[entry] > 0)
+            ++nPositive;
+        order[i] = sampleGenes[entry];
+        scratch.blockRanks[size_t(order[i]) * blockSamples + s] = i;
+    }
+    return n == nGenes ? nGenes : nPositive;
+}
+
+float Gsea::hitEnrichmentScore(uint32_t *hitRanks, uint32_t nHits, uint32_t nRanked, float posScore, float negScore,
+                               vector<uint64_t> &hitBits)
 {
-    uint samplesPerThread = nSamples / nThreads;
-    uint offset = nSamples % samplesPerThread;
-    vector<thread> threads = vector<thread>(nThreads);
-    for (uint i = 0; i < nThreads; ++i)
-    {
-        uint startSample = i * samplesPerThread;
-        uint endSample = startSample + samplesPerThread;
-        if (i == nThreads - 1)
-            endSample += offset;
-        threads[i] = thread(&Gsea::enrichmentScoreJob, this, startSample, endSample);
-        if (i == nThreads - 1)
+    // Many hits are put in rank order through a bitmap of the ranked positions, scanning it is cheaper than sorting them
+    uint32_t nWords = (nRanked + 63) / 64;
+    if (nHits * 4 >= nWords)
+    {
+        if (hitBits.size() < nWords)
+            hitBits.resize(nWords, 0);
+        for (uint32_t h = 0; h < nHits; ++h)
+            hitBits[hitRanks[h] / 64] |= uint64_t(1) << (hitRanks[h] % 64);
+        uint32_t h = 0;
+        for (uint32_t w = 0; w < nWords; ++w)
         {
-            auto threadId = threads[i].get_id();
-            logThread = *static_cast<unsigned int *>(static_cast<void *>(&threadId));
+            for (uint64_t word = hitBits[w]; word != 0; word &= word - 1)
+                hitRanks[h++] = w * 64 + __builtin_ctzll(word);
+            hitBits[w] = 0;
         }
     }
+    else
+        sort(hitRanks, hitRanks + nHits);
 
-    for (thread &t : threads)
-        t.join();
+    // Running sum at the first position when it is not a hit, otherwise it is never the maximum
+    float maxValue = negScore;
+    for (uint32_t h = 0; h < nHits; ++h)
+    {
+        float value = posScore * (h + 1) + negScore * (hitRanks[h] - h);
+        maxValue = max(value, maxValue);
+    }
+    return maxValue;
 }
 
-void Gsea::enrichmentScoreJob(uint startSample, uint endSample)
+float Gsea::denseEnrichmentScore(const uint32_t *hitRanks, uint32_t nHits, uint32_t nRanked,
+                                 float posScore, float negScore, vector<uint8_t> &hitMask)
 {
-    assert(endSample <= nSamples);
+    if (hitMask.size() < nRanked + hitMaskPadding)
+        hitMask.resize(nRanked + hitMaskPadding, 0);
+
+    for (uint32_t h = 0; h < nHits; ++h)
+        hitMask[hitRanks[h]] = 1;
+    float maxValue = runningSumMax(hitMask.data(), nRanked, posScore, negScore);
+    for (uint32_t h = 0; h < nHits; ++h)
+        hitMask[hitRanks[h]] = 0;
+    return maxValue;
+}
 
-    sortColumnsJob(startSample, endSample);
+void Gsea::blockEnrichmentScore(uint k, KernelScratch &scratch, float *values) const
+{
+    const uint blockSamples = KernelScratch::blockSamples;
+    uint nBlockSamples = scratch.nBlockSamples;
+    uint32_t nMembers = geneSetIndex.nMembers(k);
+    const uint32_t *members = geneSetIndex.members + geneSetIndex.offsets[k];
+
+    // A gene set with every gene has no misses, its running sum stays at 0 while negScore would be infinite. The
+    // effective size leaves out the absent members, so a gene set with every gene and some absent ones is one too
+    if (nMembers == nGenes)
+    {
+        fill(values, values + nBlockSamples, 0.0f);
+        return;
+    }
 
-    auto threadId = this_thread::get_id();
-    uint id = *static_cast<unsigned int *>(static_cast<void *>(&threadId));
+    float geneSetSize = nMembers;
+    float posScore = sqrt((nGenes - geneSetSize) / geneSetSize);
+    float negScore = -sqrt((geneSetSize / (nGenes - geneSetSize)));
 
-    for (uint k = 0; k < nGeneSets; ++k)
+    // The ranks of a member in every block sample are contiguous, so the members are read once per block
+    scratch.blockHits.resize(size_t(nMembers) * blockSamples);
+    uint32_t *blockHits = scratch.blockHits.data();
+    uint32_t nHits[blockSamples] = {};
+    for (uint32_t m = 0; m < nMembers; ++m)
     {
-        float geneSetSize = geneSets[k].geneSet.size();
-        float posScore = sqrt((nGenes - geneSetSize) / geneSetSize);
-        float negScore = -sqrt((geneSetSize / (nGenes - geneSetSize)));
-        for (uint j = startSample; j < endSample; ++j)
+        const uint32_t *ranks = scratch.blockRanks.data() + size_t(members[m]) * blockSamples;
+        for (uint s = 0; s < nBlockSamples; ++s)
         {
-            float currentValue = 0;
-            float maxValue = 0;
-            for (uint i = 0; i < nGenes; ++i)
+            blockHits[s * nMembers + nHits[s]] = ranks[s];
+            nHits[s] += ranks[s] < scratch.nRanked[s];
+        }
+    }
+
+    for (uint s = 0; s < nBlockSamples; ++s)
+    {
+        uint32_t *hitRanks = blockHits + s * nMembers;
+        if (scratch.nRanked[s] == 0)
+            values[s] = 0;
+        else if (preferRunningSumMax(nMembers, scratch.nRanked[s]))
+            values[s] = denseEnrichmentScore(hitRanks, nHits[s], scratch.nRanked[s], posScore, negScore, scratch.hitMask);
+        else
+            values[s] = hitEnrichmentScore(hitRanks, nHits[s], scratch.nRanked[s], posScore, negScore, scratch.hitBits);
+    }
+}
+
+uint Gsea::setBlocksPerSample(uint nSampleBlocks) const
+{
+    // Gene sets are only split when there are too few sample blocks to keep every worker busy
+    uint minTiles = 4 * pool->size();
+    if (nSampleBlocks == 0 or nSampleBlocks >= minTiles)
+        return 1;
+    return max(1u, min(nGeneSets, (minTiles + nSampleBlocks - 1) / nSampleBlocks));
+}
+
+uint Gsea::sampleBlocks(uint nBlockedSamples)
+{
+    return (nBlockedSamples + KernelScratch::blockSamples - 1) / KernelScratch::blockSamples;
+}
+
+template <typename T>
+void Gsea::enrichmentScoreTile(const MatrixView<T> &matrix, float *const *scores, MatrixLayout scoresLayout,
+                               bool scRnaKernel, uint setBlocks, uint tile, uint worker)
+{
+    uint firstSample = tile / setBlocks * KernelScratch::blockSamples;
+    uint block = tile % setBlocks;
+    uint startSet = ulong(nGeneSets) * block / setBlocks;
+    uint endSet = ulong(nGeneSets) * (block + 1) / setBlocks;
+    assert(firstSample < matrix.nSamples);
+
+    // Consecutive tiles of the same sample block reuse its ranking
+    KernelScratch &scratch = scratches[worker];
+    const T *blockData = matrix.data + firstSample * matrix.sampleStride;
+    if (scratch.rankedBlock != blockData)
+    {
+        PhaseTimer rankTimer(instrumentation, RankPhase);
+        scratch.nBlockSamples = min(KernelScratch::blockSamples, matrix.nSamples - firstSample);
+        const float *counts = nullptr;
+        size_t countsStride = nGenes;
+        if constexpr (is_same<T, float>::value)
+        {
+            if (matrix.geneStride == 1)
             {
-                if (geneSets[k].geneSet.find(geneIds[expressionMatrix[i][j].geneId]) != geneSets[k].geneSet.end())
-                {
-                    currentValue += posScore;
-                }
-                else
-                    currentValue += negScore;
-
-                if (i == 0)
-                    maxValue = currentValue;
-                maxValue = max(currentValue, maxValue);
+                counts = blockData;
+                countsStride = matrix.sampleStride;
             }
-            results[k][j] = maxValue;
         }
-        if (k != 0 and id == logThread and k % ioutput == 0)
+        if (counts == nullptr)
         {
-            system_clock::time_point now = system_clock::now();
-            printTime(now);
-            cout << " Gene set " << k;
+            scratch.blockCounts.resize(size_t(scratch.nBlockSamples) * nGenes);
+            matrix.copySamples(firstSample, scratch.nBlockSamples, scratch.blockCounts.data());
+            counts = scratch.blockCounts.data();
+        }
 
-            ulong ETA = (geneSets.size() - k) * duration_cast<milliseconds>(now - startGSEATime).count() / (k * 60 * 1000);
-            cout << " ETA: " << ETA << " min" << endl;
+        for (uint s = 0; s < scratch.nBlockSamples; ++s)
+        {
+            scratch.nRanked[s] = rankSample(counts + s * countsStride, scratch, s);
+            // Genes after the first null count are only ignored by the scRNA kernel
+            if (not scRnaKernel)
+                scratch.nRanked[s] = nGenes;
         }
+        scratch.rankedBlock = blockData;
+        instrumentation.addBytes(RankPhase, ulong(scratch.nBlockSamples) * nGenes * sizeof(T));
     }
-}
 
-void Gsea::scEnrichmentScoreJob(uint startSample, uint endSample)
-{
-    assert(endSample <= nSamples);
-
-    for (uint i = startSample; i < endSample; ++i)
+    PhaseTimer scoreTimer(instrumentation, ScorePhase);
+    instrumentation.addBytes(ScorePhase, ulong(scratch.nBlockSamples) * (endSet - startSet) * sizeof(float));
+    float values[KernelScratch::blockSamples];
+    for (uint k = startSet; k < endSet; ++k)
     {
-        sort(expressionMatrix[i].begin(), expressionMatrix[i].end(), &Gsea::geneSampleComp);
+        blockEnrichmentScore(k, scratch, values);
+        for (uint s = 0; s < scratch.nBlockSamples; ++s)
+        {
+            if (scoresLayout == SampleMajor)
+                scores[firstSample + s][k] = values[s];
+            else
+                scores[k][firstSample + s] = values[s];
+        }
     }
+}
 
-    for (uint i = startSample; i < endSample; ++i)
+void Gsea::sparseEnrichmentScoreTile(uint firstSample, uint nTileSamples, vector<vector<float>> &scores,
+                                     uint setBlocks, uint tile, uint worker)
+{
+    uint firstBlockSample = tile / setBlocks * KernelScratch::blockSamples;
+    uint block = tile % setBlocks;
+    uint startSet = ulong(nGeneSets) * block / setBlocks;
+    uint endSet = ulong(nGeneSets) * (block + 1) / setBlocks;
+    assert(firstSample + firstBlockSample < sparseMatrix.nSamples);
+
+    // Consecutive tiles of the same sample block reuse its ranking
+    KernelScratch &scratch = scratches[worker];
+    const ulong *offsets = sparseMatrix.offsets.data() + firstSample + firstBlockSample;
+    if (scratch.rankedBlock != offsets)
     {
-        for (uint k = 0; k < nGeneSets; ++k)
+        PhaseTimer rankTimer(instrumentation, RankPhase);
+        scratch.nBlockSamples = min(KernelScratch::blockSamples, nTileSamples - firstBlockSample);
+        for (uint s = 0; s < scratch.nBlockSamples; ++s)
         {
-            float geneSetSize = geneSets[k].geneSet.size();
-            float posScore = sqrt((nGenes - geneSetSize) / geneSetSize);
-            float negScore = -sqrt((geneSetSize / (nGenes - geneSetSize)));
-            float currentValue = 0;
-            float maxValue = 0;
-            for (uint j = 0; j < nGenes; ++j)
-            {
-                if (expressionMatrix[i][j].count == 0)
-                    break;
-
-                if (geneSets[k].geneSet.find(geneIds[expressionMatrix[i][j].geneId]) != geneSets[k].geneSet.end())
-                {
-                    currentValue += posScore;
-                }
-                else
-                    currentValue += negScore;
-
-                if (j == 0)
-                    maxValue = currentValue;
-                maxValue = max(currentValue, maxValue);
-            }
-            results[i][k] = maxValue;
+            // A sample without counts has no ranked gene, so every ES is 0
+            uint32_t n = offsets[s + 1] - offsets[s];
+            scratch.nRanked[s] = 0;
+            if (n > 0)
+                scratch.nRanked[s] = rankSparseSample(sparseMatrix.geneIds.data() + offsets[s],
+                                                      sparseMatrix.counts.data() + offsets[s], n, scratch, s);
         }
+        scratch.rankedBlock = offsets;
+        instrumentation.addBytes(RankPhase, (offsets[scratch.nBlockSamples] - offsets[0]) * (sizeof(uint32_t) + sizeof(float)));
+    }
+
+    PhaseTimer scoreTimer(instrumentation, ScorePhase);
+    instrumentation.addBytes(ScorePhase, ulong(scratch.nBlockSamples) * (endSet - startSet) * sizeof(float));
+    float values[KernelScratch::blockSamples];
+    for (uint k = startSet; k < endSet; ++k)
+    {
+        blockEnrichmentScore(k, scratch, values);
+        for (uint s = 0; s < scratch.nBlockSamples; ++s)
+            scores[firstBlockSample + s][k] = values[s];
     }
 }
 
-void Gsea::writeResults()
+/**
+ * @brief Pointers to the rows of a results matrix
+ * @param rows results matrix
+ * @return Pointer to the first element of each row
+ */
+static vector<float *> rowPointers(vector<vector<float>> &rows)
+{
+    vector<float *> pointers = vector<float *>(rows.size());
+    for (uint i = 0; i < rows.size(); ++i)
+        pointers[i] = rows[i].data();
+    return pointers;
+}
+
+void Gsea::enrichmentScore()
 {
-    ofstream file(outputFilename);
-    bool first = true;
-    for (string &sampleId : sampleIds)
+    for (KernelScratch &scratch : scratches)
+        scratch.rankedBlock = nullptr;
+
+    // Workers write the ES straight into the rows of the mapped results file if there is one
+    vector<float *> scoreRows = rowPointers(results);
+    MatrixLayout scoresLayout = GeneMajor;
+    if (mappedResults.data != nullptr)
     {
-        if (first)
-            first = false;
-        else
-            file << outputSep;
-        file << sampleId;
+        scoreRows.resize(mappedResults.nSamples);
+        for (uint r = 0; r < mappedResults.nSamples; ++r)
+            scoreRows[r] = mappedResults.sample(r);
+        scoresLayout = resultsLayout;
     }
-    file << endl;
 
-    vector<string> geneSetNames = vector<string>(geneSets.size());
-    uint i = 0;
-    for (auto &it : geneSets)
+    uint setBlocks = setBlocksPerSample(sampleBlocks(nSamples));
+    uint nTiles = sampleBlocks(nSamples) * setBlocks;
+    atomic<uint> tilesDone(0);
+
+    // Samples of the sample blocks whose tiles are all done, reported every ioutput samples by the reporter thread
+    uint samplesReported = 0;
+    auto reportProgress = [&]
     {
-        geneSetNames[i] = it.geneSetId;
-        ++i;
+        uint done = tilesDone;
+        uint samplesDone = min(nSamples, done / setBlocks * KernelScratch::blockSamples);
+        if (ioutput == 0 or done == 0 or samplesDone / ioutput == samplesReported / ioutput)
+            return;
+        samplesReported = samplesDone;
+        system_clock::time_point now = system_clock::now();
+        printTime(now);
+        cout << " Sample " << samplesDone;
+
+        ulong ETA = ulong(nTiles - done) * duration_cast<milliseconds>(now - startGSEATime).count() / (ulong(done) * 60 * 1000);
+        cout << " ETA: " << ETA << " min" << endl;
+    };
+
+    MatrixView<float> floatMatrix = expressionMatrix.view();
+    {
+        ProgressReporter reporter(reportProgress);
+        pool->parallelFor(nTiles, [&](uint tile, uint worker)
+        {
+            if (doubleMatrix.data != nullptr)
+                enrichmentScoreTile(doubleMatrix, scoreRows.data(), scoresLayout, false, setBlocks, tile, worker);
+            else
+                enrichmentScoreTile(floatMatrix, scoreRows.data(), scoresLayout, false, setBlocks, tile, worker);
+            tilesDone.fetch_add(1, memory_order_relaxed);
+        });
     }
+    instrumentation.addScoredSamples(nSamples);
+}
 
-    i = 0;
-    for (vector<float> &row : results)
+template <typename T>
+void Gsea::scEnrichmentScore(const MatrixView<T> &matrix, vector<vector<float>> &batchResults)
+{
+    for (KernelScratch &scratch : scratches)
+        scratch.rankedBlock = nullptr;
+
+    vector<float *> scoreRows = rowPointers(batchResults);
+    uint setBlocks = setBlocksPerSample(sampleBlocks(matrix.nSamples));
+    pool->parallelFor(sampleBlocks(matrix.nSamples) * setBlocks, [&](uint tile, uint worker)
+    {
+        enrichmentScoreTile(matrix, scoreRows.data(), SampleMajor, true, setBlocks, tile, worker);
+    });
+}
+
+void Gsea::scEnrichmentScore(uint firstSample, uint nBatchSamples, vector<vector<float>> &batchResults)
+{
+    for (KernelScratch &scratch : scratches)
+        scratch.rankedBlock = nullptr;
+
+    uint setBlocks = setBlocksPerSample(sampleBlocks(nBatchSamples));
+    pool->parallelFor(sampleBlocks(nBatchSamples) * setBlocks, [&](uint tile, uint worker)
     {
-        file << geneSetNames[i];
-        for (float value : row)
+        sparseEnrichmentScoreTile(firstSample, nBatchSamples, batchResults, setBlocks, tile, worker);
+    });
+}
+
+void Gsea::writeResults()
+{
+    PhaseTimer writeTimer(instrumentation, WritePhase);
+    ResultWriter writer(outputFilename, outputSep, outputPrecision, pool.get());
+    writer.writeHeader(sampleIds);
+    writer.writeRows(nGeneSets, nSamples, [&](uint k, RowBuffer &buffer)
+    {
+        buffer.appendId(geneSetIndex.ids[k]);
+        if (mappedResults.data == nullptr)
+            buffer.appendValues(results[k].data(), nSamples);
+        else if (resultsLayout == GeneMajor)
+            buffer.appendValues(mappedResults.sample(k), nSamples);
+        else
         {
-            file << outputSep << value;
+            // Sample-major files store the ES of a gene set with a stride of a row
+            vector<float> values = vector<float>(nSamples);
+            for (uint j = 0; j < nSamples; ++j)
+                values[j] = mappedResults.sample(j)[k];
+            buffer.appendValues(values.data(), nSamples);
         }
-        file << endl;
-        ++i;
-    }
-    file.close();
+    });
+    if (not writer.close())
+        cerr << "[ERROR] " << outputFilename << " could not be written" << endl;
+    instrumentation.addBytes(WritePhase, writer.bytesWritten());
 }
 
 void Gsea::runRna()
 {
     enrichmentScore();
 
-    writeResults();
+    if (not outputFilename.empty())
+        writeResults();
 }
 
 void Gsea::run(string outFileName, uint ioutput)
@@ -596,7 +1367,7 @@ void Gsea::run(string outFileName, uint ioutput)
     cout << "[GSEA input size]" << endl;
     cout << "Sampled genes: " << nGenes << endl;
     cout << "Samples:       " << nSamples << endl;
-    cout << "Gene sets:     " << geneSets.size() << endl;
+    cout << "Gene sets:     " << nGeneSets << endl;
     cout << endl;
 
     startGSEATime = system_clock::now();
@@ -611,20 +1382,39 @@ void Gsea::run(string outFileName, uint ioutput)
 
     cout << endl
          << "Elapsed time: " << duration_cast<minutes>(system_clock::now() - startGSEATime).count() << " min" << endl;
-    cout << "Results written in " << outputFilename << endl;
+    if (scRna ? writeScores : not outputFilename.empty())
+        cout << "Results written in " << outputFilename << endl;
+    if (not scRna and mappedResults.data != nullptr)
+        cout << "Binary results written in " << resultsFilename << endl;
+    writeReport(scRna ? "scrna" : "rna");
+    if (scRna and nRankedGeneSets > 0)
+    {
+        writeVarianceRanking(nRankedGeneSets, outputFilename + ".var");
+        cout << "Variance ranking written in " << outputFilename << ".var" << endl;
+    }
 }
 
-void Gsea::runChunked(vector<vector<GeneSample>> &expressionMatrix)
+void Gsea::runChunked(ExprMatrix &expressionMatrix)
+{
+    runChunkedView(expressionMatrix.view());
+}
+
+void Gsea::runChunked(const MatrixView<double> &expressionMatrix)
+{
+    runChunkedView(expressionMatrix);
+}
+
+template <typename T>
+void Gsea::runChunkedView(const MatrixView<T> &chunkMatrix)
 {
     if (currentSample == 0)
         startGSEATime = system_clock::now();
 
-    uint chunkSamples = expressionMatrix.size();
+    uint chunkSamples = chunkMatrix.nSamples;
     if (chunkSamples > 0)
-        nGenes = expressionMatrix[0].size();
-    this->expressionMatrix = expressionMatrix;
+        nGenes = chunkMatrix.nGenes;
 
-    if (chunk == 0)
+    if (chunk == 0 and writeScores)
     {
         filesystem::path tmpPath = filesystem::temp_directory_path();
         ulong id = duration_cast<seconds>(startGSEATime.time_since_epoch()).count();
@@ -634,47 +1424,41 @@ void Gsea::runChunked(vector<vector<GeneSample>> &expressionMatrix)
             filesystem::create_directory(chunksPath);
         cout << "Chunks path: " << chunksPath << endl
              << endl;
-
+    }
+    if (chunk == 0)
+    {
         printTime(system_clock::now());
         cout << " Started GSEA" << endl;
     }
 
-    vector<thread> threads = vector<thread>(nThreads);
-    uint samplesPerThread = chunkSamples / nThreads;
-    uint offset = chunkSamples % nThreads;
-
     results = vector<vector<float>>(chunkSamples, vector<float>(nGeneSets));
 
-    for (uint t = 0; t < nThreads; ++t)
-    {
-        uint threadStartSample = samplesPerThread * t;
-        uint threadEndSample = threadStartSample + samplesPerThread;
-        if (t == nThreads - 1)
-        {
-            threadEndSample += offset;
-            auto threadId = threads[t].get_id();
-            logThread = *static_cast<unsigned int *>(static_cast<void *>(&threadId));
-        }
-        threads[t] = thread(&Gsea::scEnrichmentScoreJob, this, threadStartSample, threadEndSample);
-    }
+    steady_clock::time_point scoreStart = steady_clock::now();
+    scEnrichmentScore(chunkMatrix, results);
+    batchSizer.record(chunkSamples, duration<double>(steady_clock::now() - scoreStart).count());
 
-    for (thread &t : threads)
-        t.join();
+    accumulateStats(results, chunkSamples);
+    instrumentation.addScoredSamples(chunkSamples);
 
-    filesystem::path chunkFile = filesystem::path(to_string(chunk));
-    filesystem::path chunkPath = chunksPath / chunkFile;
-    ofstream resultsFile(chunkPath);
-    for (uint k = 0; k < nGeneSets; ++k)
+    // Chunks are stored gene-set-major, so filterResults reads the ES of a gene set contiguously
+    if (writeScores)
     {
-        for (uint i = 0; i < chunkSamples; ++i)
+        PhaseTimer writeTimer(instrumentation, WritePhase);
+        filesystem::path chunkFile = filesystem::path(to_string(chunk));
+        filesystem::path chunkPath = chunksPath / chunkFile;
+        ExprMatrixWriter chunkWriter(chunkPath.string(), GeneMajor, chunkSamples);
+        vector<float> row = vector<float>(chunkSamples);
+        for (uint k = 0; k < nGeneSets; ++k)
         {
-            if (i != 0)
-                resultsFile << ",";
-            resultsFile << results[i][k];
+            for (uint i = 0; i < chunkSamples; ++i)
+                row[i] = results[i][k];
+            chunkWriter.writeRow(row.data());
         }
-        resultsFile << endl;
+        if (chunkWriter.close(geneSetIds(), sampleIdRange(currentSample, chunkSamples)))
+            instrumentation.addBytes(WritePhase, filesystem::file_size(chunkPath));
+        else
+            cerr << "[ERROR] " << chunkPath.string() << " could not be written" << endl;
     }
-    resultsFile.close();
 
     system_clock::time_point now = system_clock::now();
     printTime(now);
@@ -682,13 +1466,33 @@ void Gsea::runChunked(vector<vector<GeneSample>> &expressionMatrix)
     ++chunk;
     ulong ETA = (nSamples - currentSample) * duration_cast<milliseconds>(now - startGSEATime).count() / (currentSample * 60 * 1000);
     cout << " Sample: " << currentSample << " ETA: " << ETA << " min" << endl;
+    writeReport("chunked");
+}
+
+vector<string> Gsea::sampleIdRange(uint firstSample, uint nIdSamples) const
+{
+    vector<string> ids;
+    for (uint i = firstSample; i < firstSample + nIdSamples and i < sampleIds.size(); ++i)
+        ids.push_back(sampleIds[i]);
+    ids.resize(nIdSamples);
+    return ids;
+}
+
+string Gsea::chunksDirectory() const
+{
+    return chunksPath.string();
+}
+
+vector<string> Gsea::scoredSampleIds() const
+{
+    if (chunk == 0)
+        return sampleIds;
+    return sampleIdRange(currentSample - results.size(), results.size());
 }
 
 void Gsea::filterResults(uint nFilteredGeneSets, string chunksPathStr, string outFileName)
 {
     assert(nFilteredGeneSets < nGeneSets);
-    vector<GeneSetPtr> geneSetsVar = vector<GeneSetPtr>(nGeneSets);
-    string line;
 
     if (chunksPathStr != "")
         chunksPath = filesystem::path(chunksPathStr);
@@ -703,87 +1507,209 @@ void Gsea::filterResults(uint nFilteredGeneSets, string chunksPathStr, string ou
         return;
     }
 
-    vector<ifstream> chunkFiles = vector<ifstream>(nChunks);
+    // Row k of every chunk contains the ES of gene set k for the chunk samples
+    vector<ExprMatrix> chunks = vector<ExprMatrix>(nChunks);
     for (uint i = 0; i < nChunks; ++i)
     {
         filesystem::path chunkFile = filesystem::path(to_string(i));
         filesystem::path chunkPath = chunksPath / chunkFile;
-        chunkFiles[i].open(chunkPath);
+        vector<string> chunkGeneSetIds, chunkSampleIds;
+        if (not mapExprMatrix(chunkPath.string(), chunks[i], chunkGeneSetIds, chunkSampleIds, GeneMajor) or
+            chunks[i].nSamples != nGeneSets)
+        {
+            cerr << "[ERROR] " << chunkPath.string() << " is not a chunk of " << nGeneSets << " gene sets" << endl;
+            return;
+        }
     }
 
-    for (uint i = 0; i < nGeneSets; ++i)
+    vector<GeneSetPtr> geneSetsVar = vector<GeneSetPtr>(nGeneSets);
+    uint nRanges = min(nGeneSets, 4 * pool->size());
+    pool->parallelFor(nRanges, [&](uint r, uint)
     {
-        float mean = 0;
-        uint k = 0;
-        vector<float> rowValues(nSamples);
-        for (uint j = 0; j < nChunks; ++j)
+        for (uint k = ulong(nGeneSets) * r / nRanges; k < ulong(nGeneSets) * (r + 1) / nRanges; ++k)
         {
-            getline(chunkFiles[j], line);
-            stringstream ssLine(line);
-            string valueStr;
-            while (getline(ssLine, valueStr, ','))
+            GeneSetStats stats;
+            for (const ExprMatrix &chunk : chunks)
             {
-                float value = stof(valueStr);
-                rowValues[k] = value;
-                mean += rowValues[k];
-                ++k;
+                const float *row = chunk.sample(k);
+                for (uint i = 0; i < chunk.nGenes; ++i)
+                    stats.add(row[i]);
             }
+            geneSetsVar[k] = {k, float(stats.variance())};
         }
-        mean /= nSamples;
-        float variance = 0;
-        for (uint j = 0; j < nSamples; ++j)
-        {
-            variance += pow((rowValues[j] - mean), 2);
-        }
-        variance /= nSamples;
-
-        geneSetsVar[i] = {i, variance};
-    }
+    });
 
-    sort(geneSetsVar.begin(), geneSetsVar.end(), &Gsea::geneSetPtrComp);
+    // var lists every gene set, so they are all sorted, ties keep the gene set order
+    stable_sort(geneSetsVar.begin(), geneSetsVar.end(), &Gsea::geneSetPtrComp);
     ofstream variance("var");
     for (auto x : geneSetsVar)
-        variance << geneSets[x.geneSetPtr].geneSetId << " " << x.value << endl;
+        variance << geneSetIndex.ids[x.geneSetPtr] << " " << x.value << endl;
 
-    unordered_set<string> filteredSets;
+    vector<bool> filtered = vector<bool>(nGeneSets, false);
     for (uint i = 0; i < nFilteredGeneSets; ++i)
-        filteredSets.insert(geneSets[geneSetsVar[i].geneSetPtr].geneSetId);
+        filtered[geneSetsVar[i].geneSetPtr] = true;
 
-    ofstream filteredResultsFile(outFileName);
-    for (uint i = 0; i < nSamples; ++i)
+    vector<uint> filteredGeneSets;
+    for (uint k = 0; k < nGeneSets; ++k)
     {
-        if (i != 0)
-            filteredResultsFile << ",";
-        filteredResultsFile << sampleIds[i];
+        if (filtered[k])
+            filteredGeneSets.push_back(k);
     }
-    filteredResultsFile << endl;
 
-    for (uint i = 0; i < nChunks; ++i)
+    ResultWriter writer(outFileName, ',', outputPrecision, pool.get());
+    writer.writeHeader(sampleIds);
+    writer.writeRows(filteredGeneSets.size(), nSamples, [&](uint i, RowBuffer &buffer)
     {
-        chunkFiles[i].clear();
-        chunkFiles[i].seekg(0, ios::beg);
-    }
-    for (uint i = 0; i < nGeneSets; ++i)
+        uint k = filteredGeneSets[i];
+        buffer.appendId(geneSetIndex.ids[k]);
+        for (const ExprMatrix &chunk : chunks)
+            buffer.appendValues(chunk.sample(k), chunk.nGenes);
+    });
+    if (not writer.close())
+        cerr << "[ERROR] " << outFileName << " could not be written" << endl;
+}
+
+vector<GeneSetPtr> Gsea::varianceRanking(uint nTop) const
+{
+    vector<GeneSetPtr> ranking = vector<GeneSetPtr>(nGeneSets);
+    for (uint k = 0; k < nGeneSets; ++k)
+        ranking[k] = {k, float(geneSetStats[k].variance())};
+
+    // Only the top gene sets are sorted, ties keep the gene set order
+    nTop = min(nTop, nGeneSets);
+    partial_sort(ranking.begin(), ranking.begin() + nTop, ranking.end(), [](const GeneSetPtr &g1, const GeneSetPtr &g2)
     {
-        bool filtered = filteredSets.find(geneSets[i].geneSetId) != filteredSets.end();
-        if (filtered)
-            filteredResultsFile << geneSets[i].geneSetId;
-        for (uint j = 0; j < nChunks; ++j)
-        {
-            getline(chunkFiles[j], line);
-            if (filtered)
-                filteredResultsFile << "," << line;
-        }
-        if (filtered)
-            filteredResultsFile << endl;
+        return g1.value > g2.value or (g1.value == g2.value and g1.geneSetPtr < g2.geneSetPtr);
+    });
+    ranking.resize(nTop);
+    return ranking;
+}
+
+void Gsea::writeVarianceRanking(uint nTop, string fileName) const
+{
+    ofstream file(fileName);
+    for (const GeneSetPtr &geneSet : varianceRanking(nTop))
+        file << geneSetIndex.ids[geneSet.geneSetPtr] << " " << geneSet.value << endl;
+}
+
+void Gsea::setWriteScores(bool writeScores)
+{
+    this->writeScores = writeScores;
+}
+
+void Gsea::setReportFile(string fileName)
+{
+    reportFilename = fileName;
+}
+
+void Gsea::setMemoryBudget(uint megabytes)
+{
+    memoryBudget = ulong(megabytes) << 20;
+    if (memoryBudget == 0)
+    {
+        batchSizer.reset(0, 0);
+        return;
     }
+
+    // Input row as the doubles passed by R, results row and the ES returned to R of every chunk sample
+    ulong sampleBytes = ulong(nGenes) * sizeof(double) + ulong(nGeneSets) * (sizeof(float) + sizeof(double)) +
+                        sizeof(vector<float>);
+    uint minSamples = nThreads * KernelScratch::blockSamples;
+    uint maxSamples = max<ulong>(minSamples, (ulong(nSamples) + minSamples - 1) / minSamples * minSamples);
+    BatchPlan plan = planBatches(memoryBudget, nThreads * KernelScratch::bytes(nGenes), sampleBytes, minSamples,
+                                 maxSamples, 1);
+    if (not plan.fits)
+        cerr << "[WARNING] memory-budget of " << megabytes << " MB is below a chunk of " << plan.maxSamples
+             << " samples" << endl;
+    batchSizer.reset(plan.initialSamples, plan.maxSamples);
+}
+
+uint Gsea::chunkSize() const
+{
+    return memoryBudget == 0 ? 0 : batchSizer.size();
+}
+
+void Gsea::writeReport(const string &mode) const
+{
+    if (reportFilename.empty())
+        return;
+    double wallSeconds = duration<double>(system_clock::now() - startGSEATime).count();
+    if (not instrumentation.writeReport(reportFilename, mode, nGenes, nGeneSets, wallSeconds, *pool))
+        cerr << "[WARNING] the run report could not be written in " << reportFilename << endl;
+}
+
+vector<string> Gsea::geneSetIds() const
+{
+    return geneSetIndex.ids;
+}
+
+vector<float> Gsea::coverage() const
+{
+    vector<float> fractions = vector<float>(nGeneSets);
+    for (uint k = 0; k < nGeneSets; ++k)
+        fractions[k] = float(geneSetIndex.nFound[k]) / geneSetIndex.sizes[k];
+    return fractions;
 }
 
 void Gsea::normalizeExprMatrix()
 {
-    rpm();
+    PhaseTimer normalizeTimer(instrumentation, NormalizePhase);
+    instrumentation.addBytes(NormalizePhase, ulong(nSamples) * nGenes * sizeof(float));
+
+    // Matrices owned by R are never modified, they are copied into expressionMatrix to be normalized
+    if (doubleMatrix.data != nullptr)
+    {
+        expressionMatrix = ExprMatrix(nSamples, nGenes);
+        pool->parallelFor(nSamples, [&](uint j, uint)
+        {
+            doubleMatrix.copySamples(j, 1, expressionMatrix.sample(j));
+        });
+        doubleMatrix = MatrixView<double>();
+    }
 
-    meanCenter();
+    // Fixed ranges of samples, so the sums are added in the same order whatever the number of threads
+    const uint rangeSamples = 64;
+    uint nRanges = (nSamples + rangeSamples - 1) / rangeSamples;
+    vector<float> rpmFactors = vector<float>(nSamples);
+    vector<vector<double>> rangeSums = vector<vector<double>>(nRanges);
+
+    // First pass: rpm factor of each sample and sum of every gene after rpm, a sample is read twice
+    // while it is still in cache
+    pool->parallelFor(nRanges, [&](uint r, uint)
+    {
+        vector<double> &geneSums = rangeSums[r];
+        geneSums.assign(nGenes, 0);
+        for (uint j = r * rangeSamples; j < min(nSamples, (r + 1) * rangeSamples); ++j)
+        {
+            const float *sample = expressionMatrix.sample(j);
+            float multFactor = 1000000 / vectorSum(sample, nGenes);
+            rpmFactors[j] = multFactor;
+            for (uint i = 0; i < nGenes; ++i)
+                geneSums[i] += sample[i] * multFactor;
+        }
+    });
+
+    vector<float> means = vector<float>(nGenes);
+    uint nGeneRanges = min(nGenes, 4 * pool->size());
+    pool->parallelFor(nGeneRanges, [&](uint r, uint)
+    {
+        for (uint i = ulong(nGenes) * r / nGeneRanges; i < ulong(nGenes) * (r + 1) / nGeneRanges; ++i)
+        {
+            double sum = 0;
+            for (uint s = 0; s < nRanges; ++s)
+                sum += rangeSums[s][i];
+            means[i] = sum / nSamples;
+        }
+    });
+
+    // Second pass: rpm and mean centering applied together
+    pool->parallelFor(nSamples, [&](uint j, uint)
+    {
+        float *sample = expressionMatrix.sample(j);
+        float multFactor = rpmFactors[j];
+        for (uint i = 0; i < nGenes; ++i)
+            sample[i] = sample[i] * multFactor - means[i];
+    });
 }
 
 Gsea::~Gsea() {}
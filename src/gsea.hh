@@ -4,7 +4,6 @@
 #ifndef GSEA_HH
 #define GSEA_HH
 
-#include <unordered_set>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
@@ -17,24 +16,138 @@
 #include <chrono>
 #include <filesystem>
 #include <cassert>
+#include "batchsizer.hh"
+#include "boundedqueue.hh"
+#include "csvreader.hh"
+#include "exprmatrix.hh"
+#include "genesets.hh"
+#include "instrumentation.hh"
+#include "ranking.hh"
+#include "resultwriter.hh"
+#include "eskernel.hh"
+#include "threadpool.hh"
 
 using namespace std;
 using namespace chrono;
 
-/** @struct GseaSample
- * @brief Gene count with a pointer to the position of the gene id in Gsea::geneIds */
-struct GeneSample
+/** @struct GeneRows
+ * @brief Gene ids and counts of the non null rows read from a byte range of a bulk expression matrix file */
+struct GeneRows
 {
-    uint32_t geneId;
-    float count;
+    vector<string> geneIds;
+    /// Counts of the rows in gene-major order
+    vector<float> counts;
+    /// Gene id, column and field of the first count of the range that is not a number, empty if there is none
+    string invalidCount;
+};
+
+/** @struct SparseEntries
+ * @brief Non null counts read from a byte range of a Matrix Market file */
+struct SparseEntries
+{
+    vector<uint32_t> geneIds;
+    vector<uint32_t> sampleIds;
+    vector<float> counts;
+    /// Number of entries of the range that are not numbers or have a gene or sample out of the matrix
+    ulong nInvalid = 0;
+};
+
+/** @struct ScRnaBatch
+ * @brief Batch of scRNA samples flowing through the runScRna pipeline */
+struct ScRnaBatch
+{
+    /// Counts of the batch samples, unused if the input is sparse
+    ExprMatrix expressionMatrix;
+    /// First sample of the batch in the input matrix
+    uint firstSample;
+    /// Sample ids of the batch, its size is the batch capacity
+    vector<string> sampleNames;
+    /// ES of each batch sample (rows) and gene set (columns)
+    vector<vector<float>> results;
+    /// Number of samples in the batch
+    uint nSamples;
+};
+
+/** @struct KernelScratch
+ * @brief Buffers of a worker thread reused by the ES kernels, samples are ranked and scored in blocks of
+ * blockSamples so every gene set is walked once per block */
+struct KernelScratch
+{
+    /// Maximum number of samples of a block
+    static constexpr uint blockSamples = 16;
+
+    /// Ranks of the block samples interleaved, the rank of gene g in sample s is at blockRanks[g * blockSamples + s]
+    vector<uint32_t> blockRanks;
+    /// Number of ranked positions walked by the running sum of each block sample
+    uint32_t nRanked[blockSamples];
+    /// Number of samples of the ranked block
+    uint nBlockSamples = 0;
+    /// First sample of the ranked block (its counts or its sparse offset), nullptr if there is none
+    const void *rankedBlock = nullptr;
+    /// True if blockRanks only holds the ranks of the genes in blockOrders, the other ones have rank nGenes
+    bool sparseRanks = false;
+    /// Gene ids of each block sample in rank order
+    vector<uint32_t> blockOrders[blockSamples];
+    RankScratch rankScratch;
+    /// Hit ranks of a gene set, the ones of block sample s start at s * number of members
+    vector<uint32_t> blockHits;
+    /// Membership mask over the ranked positions used by the dense kernel, all zeros between uses
+    vector<uint8_t> hitMask;
+    /// Bitmap over the ranked positions used to order the hits, all zeros between uses
+    vector<uint64_t> hitBits;
+    /// Counts of the block samples converted to floats, used when the matrix is not a float sample-major one
+    vector<float> blockCounts;
+
+    /**
+    * @brief Approximate size of the buffers of a worker
+    * @param nGenes number of genes ranked
+    * @return Bytes of the buffers once they are sized for nGenes genes
+    */
+    static ulong bytes(uint nGenes) { return ulong(nGenes) * (3 * blockSamples + 4) * sizeof(uint32_t); }
 };
 
-/** @struct GseaSet
- * @brief Gene set struct containing the gene set id and its genes in a set */
-struct GeneSet
+/** @struct GeneSetStats
+ * @brief Running mean and variance (Welford) of the ES of a gene set, accumulators of disjoint samples can be merged */
+struct GeneSetStats
 {
-    string geneSetId;
-    unordered_set<string> geneSet;
+    /// Number of accumulated ES
+    ulong n = 0;
+    double mean = 0;
+    /// Sum of the squared differences to the mean
+    double m2 = 0;
+
+    /**
+    * @brief Accumulates an ES
+    * @param value ES
+    */
+    void add(float value)
+    {
+        ++n;
+        double delta = value - mean;
+        mean += delta / n;
+        m2 += delta * (value - mean);
+    }
+
+    /**
+    * @brief Accumulates the ES accumulated by other
+    * @param other accumulator of other samples
+    */
+    void merge(const GeneSetStats &other)
+    {
+        if (other.n == 0)
+            return;
+        ulong total = n + other.n;
+        double delta = other.mean - mean;
+        mean += delta * other.n / total;
+        m2 += other.m2 + delta * delta * (double(n) * other.n / total);
+        n = total;
+    }
+
+    /**
+    * @brief Population variance of the accumulated ES
+    * @return Variance, 0 if there are no ES
+    */
+    double variance() const { return n == 0 ? 0 : m2 / n; }
 };
 
 /** @struct GseaSetPtr
@@ -63,20 +176,56 @@ private:
     uint nThreads;
     bool normalizedData;
     bool scRna;
-
-    /// Thread in charge of printing the status
-    uint logThread;
+    /// False to only accumulate geneSetStats in runScRna and runChunked, without writing the ES
+    bool writeScores;
+    /// Number of most variable gene sets written by run after runScRna, 0 to write none
+    uint nRankedGeneSets;
+    /// Significant digits of the written ES, 0 for the shortest representation that reads back the same float
+    uint outputPrecision;
+    /// Binary file backing the bulk results, empty to keep them in memory
+    string resultsFilename;
+    /// Layout of resultsFilename, GeneMajor stores a row per gene set and SampleMajor a row per sample
+    MatrixLayout resultsLayout;
+    /// JSON run report written by run and runChunked, empty to write none
+    string reportFilename;
+    /// Bytes of the runScRna batches in flight and of the chunks recommended by chunkSize, 0 to use batchSize
+    ulong memoryBudget;
+
+    /// True if the expression matrix file is a binary expression matrix, see exprmatrix.hh
+    bool binaryExprMatrix;
+    /// True if the expression matrix file is a Matrix Market file, read into sparseMatrix
+    bool sparseExprMatrix;
+
+    /// Worker threads shared by parsing and the ES kernels
+    unique_ptr<ThreadPool> pool;
+    /// Time and bytes of every phase, see instrumentation.hh
+    Instrumentation instrumentation;
+    /// Buffers of each pool worker
+    vector<KernelScratch> scratches;
+
+    /// Number of batches allocated by the runScRna pipeline, or the minimum with a memory budget
+    static const uint pipelineDepth = 3;
+    /// Largest batch planned for a memory budget when the number of samples is unknown
+    static const uint maxBatchSamples = 1 << 16;
+    /// Samples per runScRna batch or runChunked chunk, adapted to the throughput with a memory budget
+    BatchSizer batchSizer;
 
     /// Variable to keep track of the current sample while running runChunked()
     uint currentSample;
     /// Path to the folder where chunks are saved
     filesystem::path chunksPath;
 
-    /// Array containing the gene sets
-    vector<GeneSet> geneSets;
-
-    /// Matrix containing the gene counts
-    vector<vector<GeneSample>> expressionMatrix;
+    /// Gene sets reconciled with geneIds, used by the ES kernels
+    GeneSetIndex geneSetIndex;
+    /// Gene set index cache file, empty if it is not used
+    string geneSetsCache;
+
+    /// Matrix containing the gene counts, samples are contiguous
+    ExprMatrix expressionMatrix;
+    /// Counts of a matrix owned by R, scored in place instead of expressionMatrix if data is not nullptr
+    MatrixView<double> doubleMatrix;
+    /// Non null gene counts of a sparse scRNA expression matrix
+    SparseExprMatrix sparseMatrix;
     /// Array containing sample ids
     vector<string> sampleIds;
     /// Array containing gene ids
@@ -84,6 +233,11 @@ private:
 
     /// Matrix containing GSEA results
     vector<vector<float>> results;
+    /// Bulk results mapped from resultsFilename instead of results, its rows follow resultsLayout and its
+    /// genes are the gene sets
+    ExprMatrix mappedResults;
+    /// ES statistics of each gene set over the samples scored by runScRna or runChunked
+    vector<GeneSetStats> geneSetStats;
 
     /// Number of genes in the expression matrix
     uint nGenes;
@@ -95,14 +249,6 @@ private:
     /// Time point when GSEA was started
     system_clock::time_point startGSEATime;
 
-    /**
-    * @brief GeneSample comparator function to sort gene samples in decreasing order
-    * @param g1 first GeneSample
-    * @param g2 second GeneSample
-    * @return True if g1.count is bigger than g2.count, false otherwise
-    */
-    static bool geneSampleComp(const GeneSample &g1, const GeneSample &g2);
-
     /**
     * @brief GeneSetPtr comparator function to sort gene samples in decreasing order
     * @param g1 first GeneSetPtr
@@ -111,14 +257,162 @@ private:
     */
     static bool geneSetPtrComp(const GeneSetPtr &g1, const GeneSetPtr &g2);
 
+    /**
+    * @brief Reads the bulk expression matrix and the gene sets, the expression matrix is split in
+    * nThreads byte ranges aligned to lines that are parsed in parallel
+    * @post The expression matrix, its gene ids, sample ids and the gene sets are initialised
+    */
     void readRna();
 
+    /**
+    * @brief Parses the lines of a bulk expression matrix file starting in the byte range [start, end), null rows are dropped
+    * @param reader expression matrix file reader
+    * @param start start of the byte range, at the start of a line
+    * @param end end of the byte range
+    * @param rows rows of the byte range
+    * @post rows contains the gene ids and counts of the non null rows of the range, in file order
+    */
+    void readRnaJob(const CsvReader &reader, size_t start, size_t end, GeneRows &rows) const;
+
+    /**
+    * @brief Reads the gene ids of the scRNA expression matrix, or maps the whole matrix if it is binary
+    * @post Gene ids are initialised, sample ids and the expression matrix too if it is binary
+    */
     void readScRna();
 
+    /**
+    * @brief Reads a Matrix Market scRNA expression matrix with genes as rows and samples as columns, as the
+    * 10x matrix.mtx files. Gene ids are read from the features.tsv (or genes.tsv) file next to it and sample ids
+    * from barcodes.tsv. The entries are split in byte ranges aligned to lines that are parsed in parallel.
+    * @post sparseMatrix, gene ids and sample ids are initialised
+    */
+    void readMatrixMarket();
+
+    /**
+    * @brief Parses the entries of a Matrix Market file starting in the byte range [start, end), null counts are dropped
+    * @param reader Matrix Market file reader
+    * @param start start of the byte range, at the start of a line
+    * @param end end of the byte range
+    * @param pattern true if the file has no values, every entry is then a count of 1
+    * @param entries entries of the byte range
+    * @post entries contains the zero-based genes, samples and counts of the range, in file order
+    */
+    void readMatrixMarketJob(const CsvReader &reader, size_t start, size_t end, bool pattern, SparseEntries &entries) const;
+
+    /**
+    * @brief Reads a 10x features/barcodes file
+    * @param fileName tab separated file with an id per line
+    * @param column column of the id, the first column is used for lines with fewer columns
+    * @param ids array where the ids are appended
+    */
+    void readMatrixMarketIds(const filesystem::path &fileName, uint column, vector<string> &ids) const;
+
+    /**
+    * @brief Reads the gene sets file
+    * @return Gene sets of the file
+    */
+    GeneSets readGeneSets() const;
+
+    /**
+    * @brief Reads the next batch of scRNA samples
+    * @param reader csv reader positioned at the next sample, nullptr if the input is binary or sparse
+    * @param mappedMatrix whole binary expression matrix, unused if reader is not nullptr or the input is sparse
+    * @param firstSample number of samples already read
+    * @param maxSamples maximum number of samples read, at most the batch capacity
+    * @param batch batch where the samples are read
+    * @post The batch contains the next samples, batch.nSamples is 0 if there are no more samples
+    */
+    void readScRnaBatch(CsvReader *reader, const ExprMatrix &mappedMatrix, uint firstSample, uint maxSamples,
+                        ScRnaBatch &batch);
+
+    /**
+    * @brief Runs the scRNA gsea for all the samples of a matrix on the thread pool
+    * @param matrix expression matrix
+    * @param batchResults results matrix with a row for each sample of matrix
+    * @post The rows of batchResults contain the ES
+    */
+    template <typename T>
+    void scEnrichmentScore(const MatrixView<T> &matrix, vector<vector<float>> &batchResults);
+
+    /**
+    * @brief Runs the scRNA gsea for consecutive samples of sparseMatrix on the thread pool
+    * @param firstSample first sample
+    * @param nBatchSamples number of samples
+    * @param batchResults results matrix with a row for each sample
+    * @post The rows of batchResults contain the ES of samples [firstSample, firstSample + nBatchSamples)
+    */
+    void scEnrichmentScore(uint firstSample, uint nBatchSamples, vector<vector<float>> &batchResults);
+
+    /**
+    * @brief Accumulates the ES of scored samples into geneSetStats, the gene sets are split in ranges
+    * accumulated in parallel and merged in sample order, so the statistics do not depend on the scheduling
+    * @param batchResults results matrix with a row for each sample
+    * @param nBatchSamples number of scored samples
+    * @post geneSetStats contains the statistics of the samples
+    */
+    void accumulateStats(const vector<vector<float>> &batchResults, uint nBatchSamples);
+
+    /**
+    * @brief Parser stage of runScRna, it fills free batches with the next samples
+    * @param reader csv reader positioned at the first sample, nullptr if the input is binary or sparse
+    * @param mappedMatrix whole binary expression matrix, unused if reader is not nullptr or the input is sparse
+    * @param freeBatches batches ready to be filled
+    * @param parsedBatches batches ready to be scored, closed after the last sample is read
+    */
+    void readScRnaStage(CsvReader *reader, const ExprMatrix &mappedMatrix,
+                        BoundedQueue<unique_ptr<ScRnaBatch>> &freeBatches,
+                        BoundedQueue<unique_ptr<ScRnaBatch>> &parsedBatches);
+
+    /**
+    * @brief Writer stage of runScRna, it writes the scored batches in order and returns them to freeBatches
+    * @param writer output file writer, nullptr if the ES are not written
+    * @param scoredBatches batches ready to be written
+    * @param freeBatches batches ready to be filled
+    */
+    void writeScRnaStage(ResultWriter *writer,
+                         BoundedQueue<unique_ptr<ScRnaBatch>> &scoredBatches,
+                         BoundedQueue<unique_ptr<ScRnaBatch>> &freeBatches);
+
+    /**
+    * @brief Threads of the pool formatting the runScRna results, formatting a batch takes a fraction of the time
+    * of scoring it
+    * @return A quarter of the scoring threads, at least 1
+    */
+    uint formatThreads() const;
+
+    /**
+    * @brief Plans the runScRna batches, see batchsizer.hh
+    * @return Batches of memoryBudget, or pipelineDepth batches of nThreads * batchSize samples without a budget
+    */
+    BatchPlan planScRnaBatches() const;
+
+    /**
+    * @brief Runs the scRNA gsea as a pipeline of three stages connected by bounded queues: parsing,
+    * scoring and writing, so the three of them overlap and only the planned batches are in memory
+    * @post outputFilename contains the ES of every sample if writeScores, geneSetStats their statistics
+    */
     void runScRna();
 
     void runRna();
 
+    /**
+    * @brief Writes the run report into reportFilename if it is not empty
+    * @param mode run mode written in the report
+    */
+    void writeReport(const string &mode) const;
+
+    /**
+    * @brief Allocates the bulk results, in memory or in resultsFilename if it is not empty
+    * @post results or mappedResults has a zeroed ES for every gene set and sample
+    */
+    void allocateResults();
+
+    /**
+    * @brief Starts the thread pool with nThreads workers
+    * @post pool and scratches are initialised
+    */
+    void startPool();
+
     /**
     * @brief Reads the gsea.config file
     * @post All configuration variables are set up
@@ -126,43 +420,137 @@ private:
     void readConfig();
 
     /**
-    * @brief Rpm the expression matrix
-    * @post Each expression matrix row sums 1 million
+    * @brief Prepares geneSetIndex, it is mapped from geneSetsCache if it was built from the same gene sets
+    * collection and gene universe. Otherwise the gene sets are reconciled with the gene universe of the
+    * expression matrix in one pass (see buildGeneSetIndex) and the index is written into geneSetsCache.
+    * Gene sets without any gene of the expression matrix are dropped and the coverage is reported.
+    * @param readCollection returns the gene sets collection, it is only called if the cache can not be used
+    * @param collectionHash hash of the gene sets collection, unused if geneSetsCache is empty
+    * @pre geneIds and geneSetsCache are initialised
+    * @post geneSetIndex contains the members present in geneIds of the gene sets that have any, nGeneSets is
+    * their number
     */
-    void rpm();
+    void prepareGeneSets(const function<GeneSets()> &readCollection, uint64_t collectionHash);
 
     /**
-    * @brief Mean center the expression matrix
-    * @post The expression matrix is mean centered rowwise
+    * @brief Ranks the genes of a sample in decreasing count order, ties in increasing gene id order
+    * @param counts nGenes contiguous gene counts of the sample
+    * @param scratch worker buffers
+    * @param s block sample
+    * @post scratch.blockRanks contains the position of every gene in the ranked sample for block sample s
+    * @return Number of genes ranked before the first null count, nGenes if there is no null count
     */
-    void meanCenter();
+    uint32_t rankSample(const float *counts, KernelScratch &scratch, uint s) const;
 
-    void sortColumnsJob(uint columnStart, uint columnEnd);
+    /**
+    * @brief Ranks the non null genes of a sparse sample in decreasing count order, the null genes are left
+    * unranked since the scRNA kernel never walks past the first null count
+    * @param sampleGenes increasing gene ids of the n non null counts
+    * @param counts n non null counts
+    * @param n number of non null counts
+    * @param scratch worker buffers
+    * @param s block sample
+    * @post scratch.blockRanks contains the position of the n genes for block sample s, and nGenes for the genes
+    * not in sampleGenes
+    * @return Number of positive counts, nGenes if the sample has no null count
+    */
+    uint32_t rankSparseSample(const uint32_t *sampleGenes, const float *counts, uint32_t n, KernelScratch &scratch, uint s) const;
 
     /**
-    * @brief Runs the gsea for all the expression matrix, dividing it in nThreads
-    * @pre expressionMatrix rows contain genes, expressionMatrix columns contain samples
-    * @post The samples in the results matrix contain the ES
+    * @brief Computes an ES from the ranks of the gene set hits only, the running sum only changes its slope at
+    * the hits so its maximum is either at the first position or at one of the hits
+    * @param hitRanks first of the nHits ranks of the hits, they are sorted
+    * @param nHits number of hits
+    * @param nRanked number of ranked positions walked by the running sum
+    * @param posScore running sum increment of a hit
+    * @param negScore running sum increment of a miss
+    * @param hitBits scratch bitmap of zeros, left as zeros
+    * @return The ES
     */
-    void enrichmentScore();
+    static float hitEnrichmentScore(uint32_t *hitRanks, uint32_t nHits, uint32_t nRanked, float posScore, float negScore,
+                                    vector<uint64_t> &hitBits);
+
+    /**
+    * @brief Computes an ES with the dense kernel, marking the hits in a mask over the ranked positions and
+    * computing the running sum as a prefix sum of the mask
+    * @param hitRanks first of the nHits ranks of the hits
+    * @param nHits number of hits
+    * @param nRanked number of ranked positions walked by the running sum
+    * @param posScore running sum increment of a hit
+    * @param negScore running sum increment of a miss
+    * @param hitMask scratch mask of zeros, left as zeros
+    * @return The ES
+    */
+    static float denseEnrichmentScore(const uint32_t *hitRanks, uint32_t nHits, uint32_t nRanked,
+                                      float posScore, float negScore, vector<uint8_t> &hitMask);
+
+    /**
+    * @brief Computes the ES of a gene set for every sample of the ranked block. The ranks of the block samples
+    * are read together for each member, and then each sample is scored with the kernel expected to be faster
+    * for the set size.
+    * @param k gene set
+    * @param scratch worker buffers holding the ranked block
+    * @param values array of scratch.nBlockSamples ES
+    * @post values contains the ES of the gene set k for each block sample, 0 for the samples without ranked genes
+    * and for every sample if the gene set has every gene
+    */
+    void blockEnrichmentScore(uint k, KernelScratch &scratch, float *values) const;
+
+    /**
+    * @brief Number of gene set blocks each sample block is split in, so that there are enough tiles for every pool worker
+    * @param nSampleBlocks number of sample blocks scored
+    * @return Number of gene set blocks per sample block
+    */
+    uint setBlocksPerSample(uint nSampleBlocks) const;
+
+    /**
+    * @brief Number of sample blocks of a number of samples
+    * @param nBlockedSamples number of samples
+    * @return Number of sample blocks
+    */
+    static uint sampleBlocks(uint nBlockedSamples);
 
     /**
-    * @brief Runs the gsea from lineStart to lineEnd samples, assuming genes in the rows and samples in the columns
-    * @param startSample start sample
-    * @param endSample end sample
-    * @pre expressionMatrix rows contain genes, expressionMatrix columns contain samples
-    * @post The samples startSample to endSample in the results matrix contain the ES
+    * @brief Runs the gsea for a tile made of a block of samples and a block of gene sets, the block samples are
+    * converted to floats first unless the matrix is a float sample-major one
+    * @param matrix expression matrix
+    * @param scores rows of the results matrix, indexed [sample][gene set] with SampleMajor, [gene set][sample] with GeneMajor
+    * @param scoresLayout layout of scores
+    * @param scRnaKernel true to ignore the genes after the first null count of each sample
+    * @param setBlocks number of gene set blocks per sample block
+    * @param tile tile index, sample block tile / setBlocks and gene set block tile % setBlocks
+    * @param worker pool worker running the tile
+    * @post scores contains the ES of the tile
     */
-    void enrichmentScoreJob(uint sampleStart, uint sampleEnd);
+    template <typename T>
+    void enrichmentScoreTile(const MatrixView<T> &matrix, float *const *scores, MatrixLayout scoresLayout,
+                             bool scRnaKernel, uint setBlocks, uint tile, uint worker);
 
     /**
-    * @brief Runs the gsea from startSample to endSample samples, assuming samples in the rows and genes in the columns
-    * @param startSample start sample
-    * @param endSample end sample
-    * @pre expressionMatrix rows contain samples, expressionMatrix columns contain genes
-    * @post The samples startSample to endSample in the results matrix contain the ES
+    * @brief Runs GSEA for a chunk of samples, see runChunked
+    * @param chunkMatrix counts of the chunk samples
     */
-    void scEnrichmentScoreJob(uint sampleStart, uint sampleEnd);
+    template <typename T>
+    void runChunkedView(const MatrixView<T> &chunkMatrix);
+
+    /**
+    * @brief Runs the scRNA gsea for a tile of sparseMatrix made of a block of samples and a block of gene sets
+    * @param firstSample first sample of the scored samples
+    * @param nTileSamples number of scored samples
+    * @param scores results matrix indexed [sample - firstSample][gene set]
+    * @param setBlocks number of gene set blocks per sample block
+    * @param tile tile index, sample block tile / setBlocks and gene set block tile % setBlocks
+    * @param worker pool worker running the tile
+    * @post scores contains the ES of the tile
+    */
+    void sparseEnrichmentScoreTile(uint firstSample, uint nTileSamples, vector<vector<float>> &scores,
+                                   uint setBlocks, uint tile, uint worker);
+
+    /**
+    * @brief Runs the gsea for all the expression matrix on the thread pool
+    * @post The samples in the results matrix contain the ES
+    */
+    void enrichmentScore();
 
     /**
     * @brief Writes the results into outputFilename
@@ -170,6 +558,14 @@ private:
     */
     void writeResults();
 
+    /**
+    * @brief Ids of consecutive samples
+    * @param firstSample first sample
+    * @param nIdSamples number of samples
+    * @return The ids of the samples [firstSample, firstSample + nIdSamples), empty for samples without id
+    */
+    vector<string> sampleIdRange(uint firstSample, uint nIdSamples) const;
+
 public:
     /**
     * @brief Gsea creator function to use the class without R, it reads the configuration from
@@ -182,49 +578,86 @@ public:
     * @brief Gsea creator function used when GSEA is using Gsea::runChunked()
     * @param sampleIds sample ids of the expression matrix
     * @param geneIds gene ids of the expression matrix
-    * @param geneSets array of gene sets
+    * @param geneSets gene sets, pass them with move to avoid copying them
     * @param nThreads number of threads used to run GSEA, 0 if all CPU threads want to be used
+    * @param geneSetsCache gene set index cache file, "" to not use it
     * @post Gene sets, sample ids and gene ids are initialised
     */
     Gsea(vector<string> &sampleIds,
          vector<string> &geneIds,
-         vector<GeneSet> &geneSets,
-         uint nThreads);
+         GeneSets geneSets,
+         uint nThreads,
+         string geneSetsCache = "");
     /**
     * @brief Gsea creator function when GSEA is run using Gsea::run()
-    * @param geneSets array of gene sets
+    * @param geneSets gene sets, pass them with move to avoid copying them
     * @param expressionMatrix expression matrix
     * @param geneIds gene ids of the expression matrix
     * @param sampleIds sample ids of the expression matrix
     * @param nThreads number of threads used to run GSEA, 0 if all CPU threads want to be used
-    * @param scRna true if rows contain samples and columns genes, false otherwise
-    * @post Gene sets, sample ids, gene ids and expression matrix are initialised
+    * @param scRna true if it is a sc-rna experiment, false otherwise
+    * @param geneSetsCache gene set index cache file, "" to not use it
+    * @post Gene sets, sample ids, gene ids and expression matrix are initialised, sharing the expression matrix buffer
+    */
+    Gsea(GeneSets geneSets,
+         const ExprMatrix &expressionMatrix,
+         vector<string> &geneIds,
+         vector<string> &sampleIds,
+         uint threads,
+         bool scRna,
+         string geneSetsCache = "");
+
+    /**
+    * @brief Gsea creator function when GSEA is run using Gsea::run() on a bulk matrix of doubles owned by the
+    * caller, as an R matrix. The matrix is scored in place, each block of samples is converted to floats when it
+    * is ranked, so it is only copied if it is normalized.
+    * @param geneSets gene sets, pass them with move to avoid copying them
+    * @param expressionMatrix view of the expression matrix, it must be valid while the Gsea object is used
+    * @param geneIds gene ids of the expression matrix
+    * @param sampleIds sample ids of the expression matrix
+    * @param nThreads number of threads used to run GSEA, 0 if all CPU threads want to be used
+    * @param geneSetsCache gene set index cache file, "" to not use it
+    * @post Gene sets, sample ids, gene ids and expression matrix view are initialised
     */
-    Gsea(vector<GeneSet> &geneSets,
-         vector<vector<GeneSample>> &expressionMatrix,
+    Gsea(GeneSets geneSets,
+         const MatrixView<double> &expressionMatrix,
          vector<string> &geneIds,
          vector<string> &sampleIds,
          uint threads,
-         bool scRna);
+         string geneSetsCache = "");
 
     /**
     * @brief Runs GSEA for the given expression matrix and gene sets in the Gsea creator function
-    * @param outFileName name of the output file
-    * @param ioutput how many gene sets between status output
-    * @post ES results are written into outFileName file
+    * @param outFileName name of the output file, "" to keep the one of gsea.config
+    * @param ioutput how many samples between status output
+    * @post scores() contains the ES of bulk data. The ES are written into the output file unless it is empty,
+    * as it is for the matrices passed by R when outFileName is ""
     */
     void run(string outFileName = "", uint ioutput = 10);
 
     /**
     * @brief Runs GSEA for the given expression matrix using the gene sets initialised in the Gsea creator function
-    * @param expressionMatrix matrix containing counts in the cells, samples in the rows and genes in the columns
-    * @post The correspinding chunk file contains the ES score for each sample and gene set
+    * @param expressionMatrix matrix containing the counts of the chunk samples
+    * @post scores() contains the ES of the chunk samples. If writeScores, the correspinding chunk file contains
+    * the ES score for each sample and gene set, as a gene-major binary expression matrix (see exprmatrix.hh)
+    * whose genes are the gene sets
     */
-    void runChunked(vector<vector<GeneSample>> &expressionMatrix);
+    void runChunked(ExprMatrix &expressionMatrix);
+
+    /**
+    * @brief Runs GSEA for a chunk of samples of a matrix of doubles owned by the caller, as an R matrix, that is
+    * scored in place
+    * @param expressionMatrix view of the counts of the chunk samples
+    * @post See runChunked
+    */
+    void runChunked(const MatrixView<double> &expressionMatrix);
 
 
     /**
-    * @brief Filter the chunked GSEA results by selecting the nFilteredGeneSets gene sets with more variance across the samples
+    * @brief Filter the chunked GSEA results by selecting the nFilteredGeneSets gene sets with more variance across the samples.
+    * The chunks are memory-mapped and the variance of every gene set is computed in a single parallel pass, the
+    * rows of the selected gene sets are then written straight from the mappings. All the gene sets sorted by
+    * decreasing variance are written into the file var.
     * @param nFilteredGeneSets number of gene sets selected to be written in the filtered results file
     * @param chunksPath path where the chunks are stored, "" if chunks where generated in the same session with runChunked()
     * @param outFileName name of the filtered results file
@@ -234,8 +667,92 @@ public:
     void filterResults(uint nFilteredGeneSets, string chunksPath, string outFilenName);
 
     /**
-    * @brief Normalize the expression matrix using rpm and centering the samples
-    * @post The expression matrix is normalized
+    * @brief Ranks the gene sets by the variance of their ES over the samples scored so far by runScRna or
+    * runChunked, without reading any chunk
+    * @param nTop number of gene sets ranked
+    * @return The min(nTop, number of gene sets) gene sets with more variance, in decreasing variance order
+    */
+    vector<GeneSetPtr> varianceRanking(uint nTop) const;
+
+    /**
+    * @brief Writes the variance ranking, a gene set id and its variance per line as in the var file of filterResults
+    * @param nTop number of gene sets ranked
+    * @param fileName output file name
+    * @post fileName contains varianceRanking(nTop)
+    */
+    void writeVarianceRanking(uint nTop, string fileName) const;
+
+    /**
+    * @brief Chooses if runScRna and runChunked write the ES of every sample
+    * @param writeScores false to only accumulate the statistics used by varianceRanking
+    */
+    void setWriteScores(bool writeScores);
+
+    /**
+    * @brief Chooses the file where run and runChunked write the JSON run report described in instrumentation.hh,
+    * runChunked rewrites it after every chunk with the totals of all the chunks
+    * @param fileName report file name, "" to write none
+    */
+    void setReportFile(string fileName);
+
+    /**
+    * @brief Sets the memory budget of the runScRna batches and of the chunks recommended by chunkSize, see
+    * batchsizer.hh
+    * @param megabytes budget in MB, 0 to use the configured batch size
+    */
+    void setMemoryBudget(uint megabytes);
+
+    /**
+    * @brief Chunk size recommended for runChunked by the memory budget, it grows after the chunks of the
+    * recommended size while their throughput improves
+    * @return Samples of the next chunk, 0 without a memory budget
+    */
+    uint chunkSize() const;
+
+    /**
+    * @brief Gene set ids
+    * @return Id of each gene set, in the order used by the results
+    */
+    vector<string> geneSetIds() const;
+
+    /**
+    * @brief Gene set coverage by the expression matrix
+    * @return Fraction of the genes of each gene set present in the expression matrix
+    */
+    vector<float> coverage() const;
+
+    /**
+    * @brief ES computed by the last run or runChunked
+    * @return After run on bulk data, the ES of gene set k and sample j at [k][j], empty if they are stored in
+    * a results file. After runChunked, the ES of chunk sample j and gene set k at [j][k]
+    */
+    const vector<vector<float>> &scores() const { return results; }
+
+    /**
+    * @brief Folder of the chunk files written by runChunked
+    * @return Path of the chunks folder, empty before the first chunk file is written
+    */
+    string chunksDirectory() const;
+
+    /**
+    * @brief Ids of the samples of scores()
+    * @return All the sample ids after run, the ids of the last chunk samples after runChunked
+    */
+    vector<string> scoredSampleIds() const;
+
+    /**
+    * @brief Writes the expression matrix read from gsea.config as a binary expression matrix (see exprmatrix.hh),
+    * scRNA matrices are converted batch by batch
+    * @param outFileName name of the binary file
+    * @post outFileName contains the expression matrix in sample-major layout
+    * @return False if the file could not be written, true otherwise
+    */
+    bool writeExprMatrix(string outFileName);
+
+    /**
+    * @brief Normalize the expression matrix using rpm and centering the samples, both are applied in two parallel
+    * passes over the matrix: one for the rpm factors and the gene means and one to apply them
+    * @post Each sample sums 1 million before being mean centered genewise
     */
     void normalizeExprMatrix();
 
@@ -3,85 +3,180 @@
 
 #include "gsearcpp.hh"
 
+/**
+ * @brief Converts an R list of gene sets into the compact gene sets collection
+ * @param geneSetsRcpp named list with a character vector of gene ids in every element
+ * @return Gene sets of the list, in the same order
+ */
+static GeneSets toGeneSets(const List &geneSetsRcpp)
+{
+    GeneSets geneSets;
+    CharacterVector geneSetsIdsRcpp = geneSetsRcpp.names();
+    vector<string> geneSetsIds = as<vector<string>>(geneSetsIdsRcpp);
+    vector<string_view> genes;
+    for (uint i = 0; i < geneSetsRcpp.length(); ++i)
+    {
+        CharacterVector geneSetRcpp = geneSetsRcpp[i];
+        vector<string> geneVector = as<vector<string>>(geneSetRcpp);
+        genes.assign(geneVector.begin(), geneVector.end());
+        geneSets.add(geneSetsIds[i], genes);
+    }
+    return geneSets;
+}
+
+/**
+ * @brief Copies a matrix of ES into an R matrix
+ * @param rows ES matrix, rows[i][j] is the ES of row i and column j
+ * @param rowIds id of every row
+ * @param columnIds id of every column
+ * @return Numeric matrix with the ES of rows and rowIds and columnIds as dimnames
+ */
+static NumericMatrix toNumericMatrix(const vector<vector<float>> &rows, const vector<string> &rowIds,
+                                     const vector<string> &columnIds)
+{
+    uint nRows = rows.size();
+    uint nColumns = columnIds.size();
+    NumericMatrix matrix(nRows, nColumns);
+    // R matrices are column-major, so row i is scattered with a stride of nRows
+    double *data = matrix.begin();
+    for (uint i = 0; i < nRows; ++i)
+    {
+        const vector<float> &row = rows[i];
+        for (uint j = 0; j < nColumns; ++j)
+            data[size_t(j) * nRows + i] = row[j];
+    }
+    rownames(matrix) = CharacterVector(rowIds.begin(), rowIds.end());
+    colnames(matrix) = CharacterVector(columnIds.begin(), columnIds.end());
+    return matrix;
+}
 
 GseaRcpp::GseaRcpp(CharacterVector sampleIdsRcpp,
                    CharacterVector geneIdsRcpp,
                    List geneSetsRcpp,
                    uint nThreads)
+    : GseaRcpp(sampleIdsRcpp, geneIdsRcpp, geneSetsRcpp, nThreads, "")
+{
+}
+
+GseaRcpp::GseaRcpp(CharacterVector sampleIdsRcpp,
+                   CharacterVector geneIdsRcpp,
+                   List geneSetsRcpp,
+                   uint nThreads,
+                   String geneSetsCache)
 {
     vector<string> sampleIds = as<vector<string>> (sampleIdsRcpp);
     vector<string> geneIds = as<vector<string>> (geneIdsRcpp);
 
-    CharacterVector geneSetsIdsRcpp = geneSetsRcpp.names();
-    vector<GeneSet> geneSets = vector<GeneSet> (geneSetsRcpp.size());
-    vector<string> geneSetsIds = as<vector<string>>(geneSetsIdsRcpp);
-    for (uint i = 0; i < geneSetsRcpp.length(); ++i)
-    {
-        CharacterVector geneSetRcpp = geneSetsRcpp[i];
-        vector<string> geneVector = as<vector<string>>(geneSetRcpp);
-        unordered_set<string> geneSet = unordered_set<string>(geneVector.begin(), geneVector.end());
-        geneSets[i] = {geneSetsIds[i], geneSet};
-    }
+    GeneSets geneSets = toGeneSets(geneSetsRcpp);
 
-    gsea = new Gsea(sampleIds, geneIds, geneSets, nThreads);
+    gsea = new Gsea(sampleIds, geneIds, move(geneSets), nThreads, geneSetsCache);
 }
 
 GseaRcpp::GseaRcpp(NumericMatrix expressionMatrixRcpp,
                    List geneSetsRcpp,
                    uint threads)
+    : GseaRcpp(expressionMatrixRcpp, geneSetsRcpp, threads, "")
+{
+}
+
+GseaRcpp::GseaRcpp(NumericMatrix expressionMatrixRcpp,
+                   List geneSetsRcpp,
+                   uint threads,
+                   String geneSetsCache)
 {
     vector<string> sampleIds, geneIds;
     sampleIds = as<vector<string>> (colnames(expressionMatrixRcpp));
     geneIds = as<vector<string>> (rownames(expressionMatrixRcpp));
-    double nGenes = expressionMatrixRcpp.nrow();
-    double nSamples = expressionMatrixRcpp.ncol();
-    vector<vector<GeneSample>> expressionMatrix(nGenes, vector<GeneSample>(nSamples));
-    for (uint i = 0; i < nGenes; ++i)
+    // R matrices are column-major, so each sample is already contiguous and the matrix is scored in place.
+    // The R object is kept so it is not garbage collected while gsea uses it.
+    this->expressionMatrixRcpp = expressionMatrixRcpp;
+    MatrixView<double> expressionMatrix;
+    expressionMatrix.nGenes = expressionMatrixRcpp.nrow();
+    expressionMatrix.nSamples = expressionMatrixRcpp.ncol();
+    expressionMatrix.data = this->expressionMatrixRcpp.begin();
+    expressionMatrix.sampleStride = expressionMatrix.nGenes;
+    expressionMatrix.geneStride = 1;
+
+    GeneSets geneSets = toGeneSets(geneSetsRcpp);
+
+    gsea = new Gsea(move(geneSets), expressionMatrix, geneIds, sampleIds, threads, geneSetsCache);
+}
+
+NumericMatrix GseaRcpp::runChunked(const NumericMatrix &countMatrixRcpp)
+{
+    // Samples are in the rows of a column-major matrix, the counts of a block of samples are read gene by gene
+    MatrixView<double> expressionMatrix;
+    expressionMatrix.nGenes = countMatrixRcpp.ncol();
+    expressionMatrix.nSamples = countMatrixRcpp.nrow();
+    expressionMatrix.data = countMatrixRcpp.begin();
+    expressionMatrix.sampleStride = 1;
+    expressionMatrix.geneStride = expressionMatrix.nSamples;
+
+    gsea->runChunked(expressionMatrix);
+
+    return toNumericMatrix(gsea->scores(), gsea->scoredSampleIds(), gsea->geneSetIds());
+}
+
+void GseaRcpp::filterResults(uint nFilteredGeneSets, string chunksPath, string outFileName)
+{
+    gsea->filterResults(nFilteredGeneSets, chunksPath, outFileName);
+}
+
+NumericVector GseaRcpp::varianceRanking(uint nTop)
+{
+    vector<GeneSetPtr> ranking = gsea->varianceRanking(nTop);
+    vector<string> geneSetIds = gsea->geneSetIds();
+    NumericVector variances(ranking.size());
+    CharacterVector names(ranking.size());
+    for (uint k = 0; k < ranking.size(); ++k)
     {
-        for (uint j = 0; j < nSamples; ++j)
-        {
-            expressionMatrix[i][j] = {i, float(expressionMatrixRcpp(i, j))};
-        }
+        variances[k] = ranking[k].value;
+        names[k] = geneSetIds[ranking[k].geneSetPtr];
     }
+    variances.names() = names;
+    return variances;
+}
 
-    CharacterVector geneSetsIdsRcpp = geneSetsRcpp.names();
-    vector<GeneSet> geneSets = vector<GeneSet> (geneSetsRcpp.size());
-    vector<string> geneSetsIds = as<vector<string>>(geneSetsIdsRcpp);
-    for (uint i = 0; i < geneSetsRcpp.length(); ++i)
+NumericVector GseaRcpp::coverage()
+{
+    vector<float> fractions = gsea->coverage();
+    vector<string> geneSetIds = gsea->geneSetIds();
+    NumericVector coverage(fractions.size());
+    CharacterVector names(fractions.size());
+    for (uint k = 0; k < fractions.size(); ++k)
     {
-        CharacterVector geneSetRcpp = geneSetsRcpp[i];
-        vector<string> geneVector = as<vector<string>>(geneSetRcpp);
-        unordered_set<string> geneSet = unordered_set<string>(geneVector.begin(), geneVector.end());
-        geneSets[i] = {geneSetsIds[i], geneSet};
+        coverage[k] = fractions[k];
+        names[k] = geneSetIds[k];
     }
+    coverage.names() = names;
+    return coverage;
+}
 
-    gsea = new Gsea(geneSets, expressionMatrix, geneIds, sampleIds, threads, false);
+void GseaRcpp::setWriteScores(bool writeScores)
+{
+    gsea->setWriteScores(writeScores);
 }
 
-void GseaRcpp::runChunked(const NumericMatrix &countMatrixRcpp)
+void GseaRcpp::setReportFile(string fileName)
 {
-    double nGenes = countMatrixRcpp.ncol();
-    double nSamples = countMatrixRcpp.nrow();
-    vector<vector<GeneSample>> expressionMatrix(nSamples, vector<GeneSample>(nGenes));
-    for (uint i = 0; i < nSamples; ++i)
-    {
-        for (uint j = 0; j < nGenes; ++j)
-        {
-            expressionMatrix[i][j] = {j, float(countMatrixRcpp(i, j))};
-        }
-    }
+    gsea->setReportFile(fileName);
+}
 
-    gsea->runChunked(expressionMatrix);
+void GseaRcpp::setMemoryBudget(uint megabytes)
+{
+    gsea->setMemoryBudget(megabytes);
 }
 
-void GseaRcpp::filterResults(uint nFilteredGeneSets, string chunksPath, string outFileName)
+uint GseaRcpp::chunkSize()
 {
-    gsea->filterResults(nFilteredGeneSets, chunksPath, outFileName);
+    return gsea->chunkSize();
 }
 
-void GseaRcpp::run(string outFileName, uint ioutput)
+NumericMatrix GseaRcpp::run(string outFileName, uint ioutput)
 {
     gsea->run(outFileName, ioutput);
+
+    return toNumericMatrix(gsea->scores(), gsea->geneSetIds(), gsea->scoredSampleIds());
 }
 
 void GseaRcpp::normalizeExprMatrix()
@@ -13,6 +13,8 @@ class GseaRcpp
 {
 private:
     Gsea *gsea;
+    /// Expression matrix scored in place by gsea, if it was created with one
+    NumericMatrix expressionMatrixRcpp;
 
 public:
     /**
@@ -28,6 +30,17 @@ public:
              List geneSetsRcpp,
              uint nThreads);
 
+    /**
+    * @brief Gsea creator function used when GSEA is using Gsea$runChunked(), with a gene set index cache file
+    * @param geneSetsCache gene set index cache file, it is used if it was built from the same gene sets and gene ids
+    * and written otherwise
+    */
+    GseaRcpp(CharacterVector sampleIdsRcpp,
+             CharacterVector geneIdsRcp,
+             List geneSetsRcpp,
+             uint nThreads,
+             String geneSetsCache);
+
     /**
     * @brief Gsea creator function when GSEA is run using Gsea$run()
     * @param geneSets gene sets as list
@@ -39,12 +52,24 @@ public:
              List geneSets,
              uint nThreads);
 
+    /**
+    * @brief Gsea creator function when GSEA is run using Gsea$run(), with a gene set index cache file
+    * @param geneSetsCache gene set index cache file, it is used if it was built from the same gene sets and gene ids
+    * and written otherwise
+    */
+    GseaRcpp(NumericMatrix expressionMatrix,
+             List geneSets,
+             uint nThreads,
+             String geneSetsCache);
+
     /**
     * @brief Runs GSEA for the given expression matrix using the gene sets initialised in the Gsea creator function
     * @param expressionMatrix numeric matrix containing counts in the cells, samples in the rows and genes in the columns
-    * @post The correspinding chunk file contains the ES score for each sample and gene set
+    * @post If the chunk files are written (see setWriteScores), the correspinding chunk file contains the ES score for
+    * each sample and gene set
+    * @return ES of the chunk, with the chunk samples in the rows and the gene sets in the columns
     */
-    void runChunked(const NumericMatrix &countMatrixRcpp);
+    NumericMatrix runChunked(const NumericMatrix &countMatrixRcpp);
 
     /**
     * @brief Filter the chunked GSEA results by selecting the nFilteredGeneSets gene sets with more variance across the samples
@@ -55,13 +80,55 @@ public:
     */
     void filterResults(uint nFilteredGeneSets, string chunksPath, string outFilename);
 
+    /**
+    * @brief Returns the gene sets with more ES variance across the samples scored so far with runChunked()
+    * @param nTop number of gene sets returned
+    * @return Variances of the nTop most variable gene sets in decreasing order, named by gene set id
+    */
+    NumericVector varianceRanking(uint nTop);
+
+    /**
+    * @brief Returns the coverage of the gene sets by the genes of the expression matrix, gene sets without any
+    * of its genes were dropped when the Gsea object was created
+    * @return Fraction of the genes of each gene set present in the expression matrix, named by gene set id
+    */
+    NumericVector coverage();
+
+    /**
+    * @brief Sets if runChunked() writes the ES of every sample into the chunk files, without them filterResults() can not
+    * be used but the variance ranking is still available
+    * @param writeScores true to write the chunk files, false otherwise
+    */
+    void setWriteScores(bool writeScores);
+
+    /**
+    * @brief Sets the file where run() and runChunked() write a JSON report with the time and bytes of every phase,
+    * the throughput, the peak memory and the busy time of every thread
+    * @param fileName report file name, "" to write none
+    */
+    void setReportFile(string fileName);
+
+    /**
+    * @brief Sets the memory budget used by chunkSize() to recommend the number of samples of every runChunked() chunk
+    * @param megabytes budget in MB, 0 for none
+    */
+    void setMemoryBudget(uint megabytes);
+
+    /**
+    * @brief Returns the number of samples of the next chunk that fits in the memory budget, it grows while the chunks
+    * of the recommended size are processed faster
+    * @return Recommended chunk size, 0 without a memory budget
+    */
+    uint chunkSize();
+
     /**
     * @brief Runs GSEA for the given expression matrix and gene sets in the Gsea creator function
-    * @param outFileName name of the output file
-    * @param ioutput number of gene sets between status output
-    * @post ES results are written into outFileName file
+    * @param outFileName name of the output file, "" to only return the results
+    * @param ioutput number of samples between status output
+    * @post ES results are written into outFileName file unless it is ""
+    * @return ES, with the gene sets in the rows and the samples in the columns as in the output file
     */
-    void run(string outFileName, uint ioutput);
+    NumericMatrix run(string outFileName, uint ioutput);
 
     /**
     * @brief Normalize the expression matrix using rpm and centering the samples
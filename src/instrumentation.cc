@@ -0,0 +1,91 @@
+/** @file instrumentation.cc
+ * @brief Instrumentation implementation file */
+
+#include "instrumentation.hh"
+#include <algorithm>
+#include <fstream>
+#include <sys/resource.h>
+
+/// Name of every phase in the report
+static const char *const phaseNames[nPhases] = {"parse", "normalize", "rank", "score", "write"};
+
+Instrumentation::Instrumentation()
+{
+    for (uint p = 0; p < nPhases; ++p)
+    {
+        phaseNanoseconds[p] = 0;
+        phaseBytes[p] = 0;
+    }
+    nScoredSamples = 0;
+}
+
+bool Instrumentation::writeReport(const string &fileName, const string &mode, uint nGenes, uint nGeneSets,
+                                  double wallSeconds, const ThreadPool &pool) const
+{
+    // ru_maxrss is in kilobytes on Linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    ulong peakRssBytes = ulong(usage.ru_maxrss) * 1024;
+
+    ulong nSamples = nScoredSamples;
+    double seconds = wallSeconds > 0 ? wallSeconds : 1e-9;
+
+    ofstream file(fileName);
+    file << "{\n";
+    file << "  \"version\": 1,\n";
+    file << "  \"mode\": \"" << mode << "\",\n";
+    file << "  \"samples\": " << nSamples << ",\n";
+    file << "  \"genes\": " << nGenes << ",\n";
+    file << "  \"geneSets\": " << nGeneSets << ",\n";
+    file << "  \"threads\": " << pool.size() << ",\n";
+    file << "  \"wallSeconds\": " << wallSeconds << ",\n";
+    file << "  \"samplesPerSecond\": " << nSamples / seconds << ",\n";
+    file << "  \"setsPerSecond\": " << nSamples * double(nGeneSets) / seconds << ",\n";
+    file << "  \"peakRssBytes\": " << peakRssBytes << ",\n";
+    file << "  \"phases\": {\n";
+    for (uint p = 0; p < nPhases; ++p)
+    {
+        file << "    \"" << phaseNames[p] << "\": {\"seconds\": " << phaseNanoseconds[p] / 1e9
+             << ", \"bytes\": " << phaseBytes[p] << "}" << (p + 1 < nPhases ? ",\n" : "\n");
+    }
+    file << "  },\n";
+    file << "  \"workers\": [\n";
+    double elapsedSeconds = pool.elapsedSeconds();
+    for (uint w = 0; w < pool.size(); ++w)
+    {
+        double busySeconds = pool.busySeconds(w);
+        file << "    {\"busySeconds\": " << busySeconds << ", \"idleSeconds\": " << max(0.0, elapsedSeconds - busySeconds)
+             << "}" << (w + 1 < pool.size() ? ",\n" : "\n");
+    }
+    file << "  ]\n";
+    file << "}\n";
+    file.close();
+    return not file.fail();
+}
+
+ProgressReporter::ProgressReporter(const function<void()> &report, chrono::milliseconds period)
+{
+    stopping = false;
+    reporter = thread([this, report, period]
+    {
+        unique_lock<mutex> lock(stopMutex);
+        while (not stopRequested.wait_for(lock, period, [this] { return stopping; }))
+        {
+            lock.unlock();
+            report();
+            lock.lock();
+        }
+        lock.unlock();
+        report();
+    });
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    {
+        lock_guard<mutex> lock(stopMutex);
+        stopping = true;
+    }
+    stopRequested.notify_all();
+    reporter.join();
+}
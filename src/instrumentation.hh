@@ -0,0 +1,157 @@
+/** @file instrumentation.hh
+ * @brief Instrumentation header file
+ *
+ * Run report (JSON object) written by Instrumentation::writeReport:
+ *
+ * | Key                 | Content                                                                      |
+ * |---------------------|------------------------------------------------------------------------------|
+ * | version             | Report format version, currently 1                                           |
+ * | mode                | "rna", "scrna" or "chunked"                                                  |
+ * | samples             | Number of samples scored                                                     |
+ * | genes               | Number of genes of the expression matrix                                     |
+ * | geneSets            | Number of gene sets scored                                                   |
+ * | threads             | Number of pool workers                                                       |
+ * | wallSeconds         | Wall time of the run                                                         |
+ * | samplesPerSecond    | samples / wallSeconds                                                        |
+ * | setsPerSecond       | ES computed per second, samples x geneSets / wallSeconds                     |
+ * | peakRssBytes        | Peak resident set size of the process                                        |
+ * | phases              | Object with the seconds and bytes of parse, normalize, rank, score and write |
+ * | workers             | Array with the busySeconds and idleSeconds of every pool worker              |
+ *
+ * The seconds of parse, normalize and write are the wall time of the thread driving them, the seconds of rank
+ * and score are summed over the workers running them concurrently. */
+
+#ifndef INSTRUMENTATION_HH
+#define INSTRUMENTATION_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "threadpool.hh"
+
+using namespace std;
+
+/** @enum Phase
+ * @brief Phases of a run measured by Instrumentation */
+enum Phase : uint
+{
+    /// Reading the expression matrix, bytes of input read
+    ParsePhase = 0,
+    /// Normalizing the expression matrix, bytes of counts normalized
+    NormalizePhase,
+    /// Ranking the genes of the samples, bytes of counts ranked
+    RankPhase,
+    /// Computing the ES from the rankings, bytes of ES computed
+    ScorePhase,
+    /// Writing the results, bytes written
+    WritePhase,
+    nPhases
+};
+
+/** @class Instrumentation
+ * @brief Lock-free counters of the time and bytes of every phase of a run, updated by any thread */
+class Instrumentation
+{
+private:
+    atomic<ulong> phaseNanoseconds[nPhases];
+    atomic<ulong> phaseBytes[nPhases];
+    /// Samples whose ES have been computed
+    atomic<ulong> nScoredSamples;
+
+public:
+    Instrumentation();
+
+    /**
+    * @brief Adds time to a phase
+    * @param phase phase
+    * @param nanoseconds time spent in the phase
+    */
+    void addTime(Phase phase, ulong nanoseconds) { phaseNanoseconds[phase] += nanoseconds; }
+
+    /**
+    * @brief Adds bytes to a phase
+    * @param phase phase
+    * @param bytes bytes processed by the phase
+    */
+    void addBytes(Phase phase, ulong bytes) { phaseBytes[phase] += bytes; }
+
+    /**
+    * @brief Counts scored samples
+    * @param nSamples number of samples whose ES have been computed
+    */
+    void addScoredSamples(ulong nSamples) { nScoredSamples += nSamples; }
+
+    /**
+    * @brief Writes the run report described in instrumentation.hh
+    * @param fileName report file name
+    * @param mode run mode
+    * @param nGenes number of genes
+    * @param nGeneSets number of gene sets
+    * @param wallSeconds wall time of the run
+    * @param pool thread pool of the run
+    * @return False if the report could not be written, true otherwise
+    */
+    bool writeReport(const string &fileName, const string &mode, uint nGenes, uint nGeneSets, double wallSeconds,
+                     const ThreadPool &pool) const;
+};
+
+/** @class PhaseTimer
+ * @brief Adds the time from its creation to its destruction to a phase */
+class PhaseTimer
+{
+private:
+    Instrumentation &instrumentation;
+    Phase phase;
+    chrono::steady_clock::time_point start;
+
+public:
+    /**
+    * @brief Starts timing a phase
+    * @param instrumentation counters where the time is added
+    * @param phase phase timed
+    */
+    PhaseTimer(Instrumentation &instrumentation, Phase phase)
+        : instrumentation(instrumentation), phase(phase), start(chrono::steady_clock::now()) {}
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+    ~PhaseTimer()
+    {
+        instrumentation.addTime(phase, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+};
+
+/** @class ProgressReporter
+ * @brief Thread that periodically reports the progress of a run, read from atomic counters, so the workers
+ * never write to the standard output */
+class ProgressReporter
+{
+private:
+    thread reporter;
+    mutex stopMutex;
+    condition_variable stopRequested;
+    bool stopping;
+
+public:
+    /**
+    * @brief Starts the reporter thread
+    * @param report function called by the reporter thread every period until it is stopped
+    * @param period time between two calls of report
+    */
+    ProgressReporter(const function<void()> &report, chrono::milliseconds period = chrono::milliseconds(200));
+
+    ProgressReporter(const ProgressReporter &) = delete;
+    ProgressReporter &operator=(const ProgressReporter &) = delete;
+
+    /**
+    * @brief Stops the reporter thread, report is called a last time before it exits
+    */
+    ~ProgressReporter();
+};
+
+#endif
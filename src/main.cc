@@ -1,7 +1,9 @@
 #include "gsea.hh"
 
-int main()
+int main(int argc, char *argv[])
 {
     Gsea gsea;
+    if (argc == 3 and string(argv[1]) == "--convert")
+        return gsea.writeExprMatrix(argv[2]) ? EXIT_SUCCESS : EXIT_FAILURE;
     gsea.run();
 }
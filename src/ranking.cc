@@ -0,0 +1,108 @@
+/** @file ranking.cc
+ * @brief Gene ranking implementation file */
+
+#include "ranking.hh"
+#include <algorithm>
+#include <cstring>
+
+/// Largest count sorted with the counting sort, beyond it the histogram costs more than the radix sort
+static const uint32_t maxCountingSortCount = 1 << 16;
+
+/**
+ * @brief Checks if the counts are non-negative integers small enough for the counting sort
+ * @param counts nGenes counts
+ * @param nGenes number of genes
+ * @param maxCount largest count
+ * @return True if the counting sort can be used, false otherwise
+ */
+static bool smallIntegerCounts(const float *counts, uint32_t nGenes, uint32_t &maxCount)
+{
+    maxCount = 0;
+    for (uint32_t i = 0; i < nGenes; ++i)
+    {
+        float count = counts[i];
+        if (not(count >= 0 and count <= maxCountingSortCount) or count != float(uint32_t(count)))
+            return false;
+        maxCount = max(maxCount, uint32_t(count));
+    }
+    return true;
+}
+
+/**
+ * @brief Maps a float to an integer whose increasing order is the decreasing order of the floats,
+ * -0 is mapped as 0 so both zeros compare equal
+ * @param value float value
+ * @return Order-preserving key
+ */
+static inline uint32_t descendingKey(float value)
+{
+    uint32_t bits;
+    if (value == 0)
+        value = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits >> 31 ? bits : ~bits & 0x7fffffff;
+}
+
+void rankGenes(const float *counts, uint32_t nGenes, RankScratch &scratch, uint32_t *order)
+{
+    uint32_t maxCount;
+    if (smallIntegerCounts(counts, nGenes, maxCount))
+    {
+        // Counting sort, bucket 0 holds the largest count
+        scratch.histogram.assign(maxCount + 2, 0);
+        for (uint32_t i = 0; i < nGenes; ++i)
+            ++scratch.histogram[maxCount - uint32_t(counts[i]) + 1];
+        for (uint32_t b = 1; b <= maxCount + 1; ++b)
+            scratch.histogram[b] += scratch.histogram[b - 1];
+        for (uint32_t i = 0; i < nGenes; ++i)
+            order[scratch.histogram[maxCount - uint32_t(counts[i])]++] = i;
+        return;
+    }
+
+    // LSD radix sort of 4 passes of 8 bits, stable so ties keep increasing gene ids
+    scratch.keys.resize(nGenes);
+    scratch.keysTmp.resize(nGenes);
+    scratch.orderTmp.resize(nGenes);
+    scratch.histogram.assign(4 * 256, 0);
+    uint32_t *histogram = scratch.histogram.data();
+    uint32_t *keys = scratch.keys.data();
+    uint32_t *keysTmp = scratch.keysTmp.data();
+    uint32_t *ids = order;
+    uint32_t *idsTmp = scratch.orderTmp.data();
+    for (uint32_t i = 0; i < nGenes; ++i)
+    {
+        uint32_t key = descendingKey(counts[i]);
+        keys[i] = key;
+        ids[i] = i;
+        for (uint pass = 0; pass < 4; ++pass)
+            ++histogram[pass * 256 + ((key >> (8 * pass)) & 0xff)];
+    }
+
+    for (uint pass = 0; pass < 4; ++pass)
+    {
+        uint32_t *digits = histogram + pass * 256;
+        uint shift = 8 * pass;
+        // Passes where all keys share the digit do not change the order
+        if (nGenes == 0 or digits[(keys[0] >> shift) & 0xff] == nGenes)
+            continue;
+
+        uint32_t offset = 0;
+        for (uint d = 0; d < 256; ++d)
+        {
+            uint32_t count = digits[d];
+            digits[d] = offset;
+            offset += count;
+        }
+        for (uint32_t i = 0; i < nGenes; ++i)
+        {
+            uint32_t position = digits[(keys[i] >> shift) & 0xff]++;
+            keysTmp[position] = keys[i];
+            idsTmp[position] = ids[i];
+        }
+        swap(keys, keysTmp);
+        swap(ids, idsTmp);
+    }
+
+    if (ids != order)
+        copy(ids, ids + nGenes, order);
+}
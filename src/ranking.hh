@@ -0,0 +1,34 @@
+/** @file ranking.hh
+ * @brief Gene ranking header file */
+
+#ifndef RANKING_HH
+#define RANKING_HH
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/** @struct RankScratch
+ * @brief Buffers reused by rankGenes between samples */
+struct RankScratch
+{
+    vector<uint32_t> keys;
+    vector<uint32_t> keysTmp;
+    vector<uint32_t> orderTmp;
+    vector<uint32_t> histogram;
+};
+
+/**
+ * @brief Sorts the genes of a sample by decreasing count, ties are sorted by increasing gene id.
+ * Non-negative integer counts (UMI counts) are sorted with a counting sort, any other counts with
+ * an LSD radix sort on their float bits mapped to order-preserving integers.
+ * @param counts nGenes counts of the sample
+ * @param nGenes number of genes
+ * @param scratch buffers reused between calls
+ * @param order array of nGenes positions
+ * @post order contains the gene ids in rank order
+ */
+void rankGenes(const float *counts, uint32_t nGenes, RankScratch &scratch, uint32_t *order);
+
+#endif
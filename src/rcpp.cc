@@ -7,19 +7,45 @@
 #include <sstream>
 #include <string>
 #include <vector>
-#include <unordered_set>
+#include "csvreader.hh"
 #include "gsea.hh"
 #include "gsearcpp.hh"
 using namespace Rcpp;
 using namespace std;
 
+/**
+ * @brief Constructor validator, the constructors with 4 arguments are told apart by their first argument
+ * @return True if the arguments are sampleIds, geneIds, geneSets and nThreads
+ */
+static bool isChunkedConstructor(SEXP *args, int nargs)
+{
+    return nargs == 4 and not Rf_isMatrix(args[0]);
+}
+
+/**
+ * @brief Constructor validator, see isChunkedConstructor
+ * @return True if the arguments are expressionMatrix, geneSets, nThreads and geneSetsCache
+ */
+static bool isMatrixCacheConstructor(SEXP *args, int nargs)
+{
+    return nargs == 4 and Rf_isMatrix(args[0]);
+}
+
 RCPP_EXPOSED_CLASS(GseaRcpp)
 RCPP_MODULE(GseaModule) {
     class_<GseaRcpp>("Gsea")
-    .constructor<CharacterVector, CharacterVector, List, uint>()
+    .constructor<CharacterVector, CharacterVector, List, uint>("", &isChunkedConstructor)
     .constructor<NumericMatrix, List, uint>()
+    .constructor<CharacterVector, CharacterVector, List, uint, String>()
+    .constructor<NumericMatrix, List, uint, String>("", &isMatrixCacheConstructor)
     .method("runChunked", &GseaRcpp::runChunked)
     .method("filterResults", &GseaRcpp::filterResults)
+    .method("varianceRanking", &GseaRcpp::varianceRanking)
+    .method("setWriteScores", &GseaRcpp::setWriteScores)
+    .method("setReportFile", &GseaRcpp::setReportFile)
+    .method("setMemoryBudget", &GseaRcpp::setMemoryBudget)
+    .method("chunkSize", &GseaRcpp::chunkSize)
+    .method("coverage", &GseaRcpp::coverage)
     .method("run", &GseaRcpp::run)
     .method("normalizeExprMatrix", &GseaRcpp::normalizeExprMatrix)
     ;
@@ -36,7 +62,6 @@ RCPP_MODULE(GseaModule) {
 void writeGeneSets(List geneSetsRcpp, String fileName)
 {
     ofstream file(fileName);
-    unordered_map<string, unordered_set<string>> geneSets;
     CharacterVector geneSetsIdsRcpp = geneSetsRcpp.names();
     vector<string> geneSetsIds = as<vector<string>>(geneSetsIdsRcpp);
     for (uint i = 0; i < geneSetsRcpp.length(); ++i)
@@ -88,6 +113,20 @@ List readGeneSets(std::string fileName)
     return geneSets;
 }
 
+/**
+ * @brief Reports a csv value that is not a number and stops
+ * @param fileName csv file name
+ * @param field field of the value
+ * @param lineNumber line of the value, starting at 1
+ * @param column column of the value, starting at 1
+ */
+static void invalidValue(const String &fileName, string_view field, ulong lineNumber, ulong column)
+{
+    cerr << "[ERROR] " << string(fileName) << ": value \"" << field << "\" in line " << lineNumber << ", column "
+         << column << " is not a number" << endl;
+    exit(EXIT_FAILURE);
+}
+
 /**
  * @brief Read a csv file as a numeric matrix
  * @param fileName input file name
@@ -99,75 +138,72 @@ List readGeneSets(std::string fileName)
  */
 // [[Rcpp::export]]
 NumericMatrix readCsv(String fileName, char sep = ',', bool hasRowNames = true, bool hasColNames = true) {
-    ifstream file(fileName);
-    if (not file.is_open()) {
+    CsvReader reader(fileName);
+    if (not reader.isOpen()) {
         cerr << "[ERROR] " << string(fileName) << " does not exist" << endl;
         exit(EXIT_FAILURE);
     }
-    string line;
+    if (sep == 't')
+        sep = '\t';
+    string_view line, field;
 
+    // The file is parsed once row by row, the column count is given by the first line
+    vector<string> colNames, rowNames;
+    vector<double> values;
     uint nCols = 0;
-    uint nRows = 0;
     bool first = true;
-    while (getline(file, line))
+    ulong lineNumber = 0;
+    while (reader.readLine(line))
     {
-        if (first) {
-            stringstream ssLine(line);
-            string valueStr;
-            while (getline(ssLine, valueStr, sep))
-                ++nCols;
+        ++lineNumber;
+        if (first and hasColNames) {
+            while (CsvReader::nextField(line, field, sep))
+                colNames.emplace_back(field);
+            nCols = colNames.size();
             first = false;
+            continue;
         }
-        ++nRows;
-    }
-
-    if (hasColNames) --nRows;
-    if (hasRowNames and not hasColNames) --nCols;
 
-    file.clear();
-    file.seekg(0, ios::beg);
-
-
-    NumericMatrix matrix(nRows, nCols);
-    CharacterVector rowNames(nRows);
-    CharacterVector colNames(nCols);
-    uint i = 0;
-    if (hasColNames) {
-        getline(file, line);
-        stringstream ssLine(line);
-        string valueStr;
-        while (getline(ssLine, valueStr, sep))
-        {
-            colNames(i) = valueStr;
-            ++i;
+        if (hasRowNames) {
+            CsvReader::nextField(line, field, sep);
+            rowNames.emplace_back(field);
         }
-    }
-
-    i = 0;
-    while (getline(file, line))
-    {
-        stringstream ssLine(line);
 
-        if (hasRowNames) {
-            string rowName;
-            getline(ssLine, rowName, sep);
-            rowNames(i) = rowName;
+        size_t rowStart = values.size();
+        if (first) {
+            while (CsvReader::nextField(line, field, sep)) {
+                values.push_back(0);
+                if (not CsvReader::parseDouble(field, values.back()))
+                    invalidValue(fileName, field, lineNumber, values.size() + hasRowNames);
+            }
+            nCols = values.size();
+            first = false;
+            continue;
         }
 
-        string valueStr;
+        values.resize(rowStart + nCols, 0);
         uint j = 0;
-        while (getline(ssLine, valueStr, sep))
+        while (j < nCols and CsvReader::nextField(line, field, sep))
         {
-            matrix(i, j) = stof(valueStr);
+            if (not CsvReader::parseDouble(field, values[rowStart + j]))
+                invalidValue(fileName, field, lineNumber, j + 1 + hasRowNames);
             ++j;
         }
-        ++i;
+    }
+
+    uint nRows = nCols == 0 ? 0 : values.size() / nCols;
+    NumericMatrix matrix(nRows, nCols);
+    double *matrixValues = matrix.begin();
+    for (uint i = 0; i < nRows; ++i)
+    {
+        for (uint j = 0; j < nCols; ++j)
+            matrixValues[size_t(j) * nRows + i] = values[size_t(i) * nCols + j];
     }
 
     if (hasRowNames)
-        rownames(matrix) = rowNames;
+        rownames(matrix) = CharacterVector(rowNames.begin(), rowNames.end());
     if (hasColNames)
-        colnames(matrix) = colNames;
+        colnames(matrix) = CharacterVector(colNames.begin(), colNames.end());
 
     return matrix;
 }
@@ -0,0 +1,121 @@
+/** @file resultwriter.cc
+ * @brief ResultWriter implementation file */
+
+#include "resultwriter.hh"
+#include <algorithm>
+#include <charconv>
+
+/// Maximum significant digits, 9 are enough to read back any float
+static const uint maxPrecision = 9;
+
+/// Approximate bytes of text formatted by a task
+static const ulong taskBytes = 1 << 20;
+
+/// Tasks of a group of rows per pool thread
+static const uint tasksPerThread = 4;
+
+/**
+ * @brief Approximate size of the text of a row
+ * @param rowLength number of values of the row
+ * @return Bytes of the row, about 12 per value
+ */
+static ulong rowBytes(uint rowLength)
+{
+    return 12 * ulong(rowLength) + 32;
+}
+
+RowBuffer::RowBuffer(char sep, uint precision)
+{
+    this->sep = sep;
+    this->precision = min(precision, maxPrecision);
+}
+
+void RowBuffer::appendId(string_view id)
+{
+    text += id;
+}
+
+void RowBuffer::appendValues(const float *values, uint nValues)
+{
+    // A separator, a sign, 9 digits, a point and a 4 character exponent at most
+    char digits[24];
+    for (uint i = 0; i < nValues; ++i)
+    {
+        digits[0] = sep;
+        to_chars_result end = precision == 0 ? to_chars(digits + 1, digits + sizeof(digits), values[i])
+                                             : to_chars(digits + 1, digits + sizeof(digits), values[i], chars_format::general, precision);
+        text.append(digits, end.ptr);
+    }
+}
+
+ResultWriter::ResultWriter(const string &fileName, char sep, uint precision, ThreadPool *pool)
+    : file(fileName, ios::binary)
+{
+    this->sep = sep;
+    this->precision = precision;
+    this->pool = pool;
+    nBytes = 0;
+}
+
+bool ResultWriter::isOpen() const
+{
+    return file.is_open();
+}
+
+void ResultWriter::writeHeader(const vector<string> &ids)
+{
+    string header;
+    for (uint i = 0; i < ids.size(); ++i)
+    {
+        if (i != 0)
+            header += sep;
+        header += ids[i];
+    }
+    header += '\n';
+    file.write(header.data(), header.size());
+    nBytes += header.size();
+}
+
+void ResultWriter::writeRows(uint nRows, uint rowLength, const function<void(uint row, RowBuffer &buffer)> &formatRow)
+{
+    // About 12 bytes per value, so every task formats about taskBytes
+    uint rowsPerTask = max<ulong>(1, taskBytes / rowBytes(rowLength));
+    uint groupTasks = tasksPerThread * pool->size();
+    if (buffers.empty())
+        buffers = vector<RowBuffer>(groupTasks, RowBuffer(sep, precision));
+
+    for (uint groupStart = 0; groupStart < nRows;)
+    {
+        uint nTasks = min<ulong>(groupTasks, (ulong(nRows - groupStart) + rowsPerTask - 1) / rowsPerTask);
+        pool->parallelFor(nTasks, [&](uint task, uint)
+        {
+            RowBuffer &buffer = buffers[task];
+            buffer.clear();
+            uint taskStart = groupStart + task * rowsPerTask;
+            uint taskEnd = min<ulong>(nRows, ulong(taskStart) + rowsPerTask);
+            for (uint i = taskStart; i < taskEnd; ++i)
+            {
+                formatRow(i, buffer);
+                buffer.endRow();
+            }
+        });
+
+        for (uint task = 0; task < nTasks; ++task)
+        {
+            file.write(buffers[task].str().data(), buffers[task].str().size());
+            nBytes += buffers[task].str().size();
+        }
+        groupStart = min<ulong>(nRows, groupStart + ulong(nTasks) * rowsPerTask);
+    }
+}
+
+ulong ResultWriter::bufferBytes(uint nThreads, uint rowLength)
+{
+    return tasksPerThread * nThreads * max(taskBytes, rowBytes(rowLength));
+}
+
+bool ResultWriter::close()
+{
+    file.close();
+    return not file.fail();
+}
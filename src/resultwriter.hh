@@ -0,0 +1,133 @@
+/** @file resultwriter.hh
+ * @brief ResultWriter header file */
+
+#ifndef RESULTWRITER_HH
+#define RESULTWRITER_HH
+
+#include <fstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "threadpool.hh"
+
+using namespace std;
+
+/** @class RowBuffer
+ * @brief Text buffer where a task formats consecutive rows of a result file */
+class RowBuffer
+{
+private:
+    string text;
+    char sep;
+    /// Significant digits of the values, 0 for the shortest representation that reads back the same float
+    uint precision;
+
+public:
+    /**
+    * @brief Creates an empty buffer
+    * @param sep separator written before every value
+    * @param precision significant digits of the values, 0 for the shortest exact representation
+    */
+    RowBuffer(char sep, uint precision);
+
+    /**
+    * @brief Appends the id that starts a row
+    * @param id row id
+    */
+    void appendId(string_view id);
+
+    /**
+    * @brief Appends values to the current row, each one preceded by the separator
+    * @param values values
+    * @param nValues number of values
+    */
+    void appendValues(const float *values, uint nValues);
+
+    /**
+    * @brief Ends the current row
+    */
+    void endRow() { text += '\n'; }
+
+    /**
+    * @brief Formatted text
+    * @return Text of the rows appended since the last clear
+    */
+    const string &str() const { return text; }
+
+    /**
+    * @brief Removes the formatted rows, keeping the allocated memory
+    */
+    void clear() { text.clear(); }
+};
+
+/** @class ResultWriter
+ * @brief Writes a delimited results file whose rows are formatted in parallel with to_chars into one buffer
+ * per task and written in order with large writes, without flushing after every row */
+class ResultWriter
+{
+private:
+    ofstream file;
+    char sep;
+    uint precision;
+    ThreadPool *pool;
+    /// Buffers of the tasks of a group of rows
+    vector<RowBuffer> buffers;
+    /// Bytes written into the file
+    ulong nBytes;
+
+public:
+    /**
+    * @brief Creates the file fileName
+    * @param fileName results file name
+    * @param sep separator of the values
+    * @param precision significant digits of the values, 0 for the shortest exact representation
+    * @param pool thread pool that formats the rows
+    */
+    ResultWriter(const string &fileName, char sep, uint precision, ThreadPool *pool);
+
+    /**
+    * @brief Checks if the file was created
+    * @return True if the file could be created, false otherwise
+    */
+    bool isOpen() const;
+
+    /**
+    * @brief Writes a row of ids separated by sep
+    * @param ids ids of the row
+    */
+    void writeHeader(const vector<string> &ids);
+
+    /**
+    * @brief Formats rows on the pool and writes them in row order. Rows are formatted in groups, so only the
+    * text of a group is held in memory.
+    * @param nRows number of rows
+    * @param rowLength approximate number of values of each row, used to size the groups
+    * @param formatRow appends row i to the buffer, formatRow(i, buffer) is called once for every i in [0, nRows)
+    * and may run concurrently for different rows
+    * @post The rows are written after the previous ones, each one followed by a newline
+    */
+    void writeRows(uint nRows, uint rowLength, const function<void(uint row, RowBuffer &buffer)> &formatRow);
+
+    /**
+    * @brief Bytes written so far
+    * @return Number of bytes written into the file
+    */
+    ulong bytesWritten() const { return nBytes; }
+
+    /**
+    * @brief Approximate size of the text buffers of a writer
+    * @param nThreads number of pool threads
+    * @param rowLength number of values of each row
+    * @return Bytes of the buffers of the groups of rows written by writeRows
+    */
+    static ulong bufferBytes(uint nThreads, uint rowLength);
+
+    /**
+    * @brief Flushes and closes the file
+    * @return True if every row was written, false otherwise
+    */
+    bool close();
+};
+
+#endif
@@ -0,0 +1,93 @@
+/** @file threadpool.cc
+ * @brief ThreadPool implementation file */
+
+#include "threadpool.hh"
+
+ThreadPool::ThreadPool(uint nThreads)
+{
+    job = nullptr;
+    nTasks = 0;
+    nextTask = 0;
+    activeWorkers = 0;
+    generation = 0;
+    stopping = false;
+
+    if (nThreads == 0)
+        nThreads = 1;
+    busyNanoseconds = make_unique<atomic<ulong>[]>(nThreads);
+    for (uint i = 0; i < nThreads; ++i)
+        busyNanoseconds[i] = 0;
+    startTime = chrono::steady_clock::now();
+    for (uint i = 0; i < nThreads; ++i)
+        workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+}
+
+uint ThreadPool::size() const
+{
+    return workers.size();
+}
+
+double ThreadPool::busySeconds(uint worker) const
+{
+    return busyNanoseconds[worker] / 1e9;
+}
+
+double ThreadPool::elapsedSeconds() const
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+}
+
+void ThreadPool::workerLoop(uint worker)
+{
+    ulong seenGeneration = 0;
+    unique_lock<mutex> lock(jobMutex);
+    while (true)
+    {
+        jobReady.wait(lock, [&] { return stopping or generation != seenGeneration; });
+        if (stopping)
+            return;
+        seenGeneration = generation;
+        const function<void(uint, uint)> &currentJob = *job;
+        uint currentTasks = nTasks;
+        lock.unlock();
+
+        chrono::steady_clock::time_point busyStart = chrono::steady_clock::now();
+        for (uint task = nextTask.fetch_add(1); task < currentTasks; task = nextTask.fetch_add(1))
+            currentJob(task, worker);
+        busyNanoseconds[worker] += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - busyStart).count();
+
+        lock.lock();
+        if (--activeWorkers == 0)
+            jobDone.notify_all();
+    }
+}
+
+void ThreadPool::parallelFor(uint nTasks, const function<void(uint task, uint worker)> &task)
+{
+    if (nTasks == 0)
+        return;
+
+    lock_guard<mutex> parallelForLock(parallelForMutex);
+    unique_lock<mutex> lock(jobMutex);
+    job = &task;
+    this->nTasks = nTasks;
+    nextTask = 0;
+    activeWorkers = workers.size();
+    ++generation;
+    jobReady.notify_all();
+
+    // Every worker checks in, so none of them can still be reading job when it goes out of scope
+    jobDone.wait(lock, [this] { return activeWorkers == 0; });
+    job = nullptr;
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(jobMutex);
+        stopping = true;
+    }
+    jobReady.notify_all();
+    for (thread &worker : workers)
+        worker.join();
+}
@@ -0,0 +1,97 @@
+/** @file threadpool.hh
+ * @brief ThreadPool header file */
+
+#ifndef THREADPOOL_HH
+#define THREADPOOL_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/** @class ThreadPool
+ * @brief Persistent worker threads that run parallel loops, tasks are claimed dynamically from a shared
+ * counter so faster workers take over the remaining tasks of slower ones */
+class ThreadPool
+{
+private:
+    vector<thread> workers;
+
+    /// Serializes parallelFor calls from different threads
+    mutex parallelForMutex;
+    mutex jobMutex;
+    condition_variable jobReady;
+    condition_variable jobDone;
+
+    /// Task function of the current loop
+    const function<void(uint, uint)> *job;
+    /// Number of tasks of the current loop
+    uint nTasks;
+    /// Next task to be claimed
+    atomic<uint> nextTask;
+    /// Workers that have not finished the current loop
+    uint activeWorkers;
+    /// Number of loops started, workers use it to detect a new loop
+    ulong generation;
+    /// True when the workers have to exit
+    bool stopping;
+    /// Time each worker has spent running tasks
+    unique_ptr<atomic<ulong>[]> busyNanoseconds;
+    /// Time the workers were started
+    chrono::steady_clock::time_point startTime;
+
+    /**
+    * @brief Main function of the worker threads
+    * @param worker worker index
+    */
+    void workerLoop(uint worker);
+
+public:
+    /**
+    * @brief Starts the worker threads
+    * @param nThreads number of worker threads, at least 1
+    */
+    ThreadPool(uint nThreads);
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+    * @brief Number of worker threads
+    * @return Number of worker threads
+    */
+    uint size() const;
+
+    /**
+    * @brief Time a worker has spent running tasks since the pool was started, the rest of elapsedSeconds() it
+    * has been idle
+    * @param worker worker index
+    * @return Busy time of the worker in seconds
+    */
+    double busySeconds(uint worker) const;
+
+    /**
+    * @brief Time since the pool was started
+    * @return Elapsed time in seconds
+    */
+    double elapsedSeconds() const;
+
+    /**
+    * @brief Runs task(i, worker) for every i in [0, nTasks) on the workers and waits for all of them
+    * @param nTasks number of tasks
+    * @param task task function, worker is the index in [0, size()) of the worker running it, so it can
+    * be used to index per worker buffers
+    * @post All the tasks have been run
+    */
+    void parallelFor(uint nTasks, const function<void(uint task, uint worker)> &task);
+
+    ~ThreadPool();
+};
+
+#endif